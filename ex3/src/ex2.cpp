@@ -16,157 +16,350 @@
 
 using namespace std;
 
+#define MAX_LOOPS (1 << 16)
+
 /*Global variables:*/
-// Struct with constructor
+// Counters of a routine, allocated when the routine is instrumented
+struct RTN_INFO {
+    ADDRINT Address;
+    string Name;
+    UINT64 InsCount;
+    UINT64 CallCount;
+
+    RTN_INFO(ADDRINT address, const string& name)
+        : Address(address), Name(name), InsCount(0), CallCount(0) {}
+};
+
+// A natural loop: the blocks that reach a back edge source without passing through the header,
+// where a back edge is an edge whose target dominates its source
 struct LOOP_INFO {
-    UINT64 CountSeen;
-    ADDRINT targetAddress;
-    ADDRINT RTN_Address;
-    string RTN_Name;
-    UINT64 CountLoopInvoked;
-    UINT64 DiffCount;
+    UINT64 CountSeen; // header executions, i.e. iterations
+    ADDRINT targetAddress; // header address
+    RTN_INFO* Rtn;
+    UINT64 CountLoopInvoked; // header executions that did not come from a back edge
+    UINT64 DiffCount; // consecutive invocations with different iteration counts
     UINT64 PREVIOUS_iterations_counter;
     UINT64 CURRENT_iterations_counter;
-    bool previously_taken;
-
-    LOOP_INFO(UINT64 count_seen, ADDRINT target_address, ADDRINT rtn_address,
-               const string& rtn_name, UINT64 count_loop_invoked, UINT64 diff_count,
-               UINT64 prev_iterations_counter, UINT64 curr_iterations_counter,
-               bool prev_taken)
-        : CountSeen(count_seen), targetAddress(target_address),
-          RTN_Address(rtn_address), RTN_Name(rtn_name),
-          CountLoopInvoked(count_loop_invoked), DiffCount(diff_count),
-          PREVIOUS_iterations_counter(prev_iterations_counter),
-          CURRENT_iterations_counter(curr_iterations_counter),
-          previously_taken(prev_taken) {}
-
-    LOOP_INFO() : LOOP_INFO(0, 0, 0, "", 0, 0, 0, 0, false) {}
+    UINT64 from_back_edge; // set by a back edge, consumed by the header
+    UINT64 CountExits; // edges taken from the loop body out of the loop
+    UINT32 Depth; // 1 for an outermost loop
+
+    LOOP_INFO(ADDRINT target_address, RTN_INFO* rtn)
+        : CountSeen(0), targetAddress(target_address), Rtn(rtn),
+          CountLoopInvoked(0), DiffCount(0),
+          PREVIOUS_iterations_counter(0),
+          CURRENT_iterations_counter(0),
+          from_back_edge(0), CountExits(0), Depth(1) {}
+
+    LOOP_INFO() : LOOP_INFO(0, nullptr) {}
 };
 
-map<ADDRINT,UINT64> RTN_MAP; //Key is RTN_Address and Value is RTN_COUNTER
-map<ADDRINT, UINT64> RTN_COUNT_MAP; //Key is RTN_Address and Value is RTN_COUNTER
+// A basic block of the static CFG of a routine, calls do not end a block
+struct BLOCK_INFO {
+    ADDRINT start;
+    INS tail;
+    vector<UINT32> succs;
+    vector<UINT32> preds;
+
+    BLOCK_INFO(ADDRINT start) : start(start), tail(INS_Invalid()) {}
+};
+
+map<ADDRINT, RTN_INFO*> RTN_MAP; //Key is RTN_Address, only used at instrumentation time
+
+// Every loop found, the analysis routines get a pointer into the array
+LOOP_INFO LOOPS[MAX_LOOPS];
+UINT32 NUM_LOOPS = 0;
+
+RTN_INFO* get_rtn_info(RTN rtn) {
+    auto it = RTN_MAP.find(RTN_Address(rtn));
+    if (it != RTN_MAP.end())
+        return it->second;
+    RTN_INFO* rtn_info = new RTN_INFO(RTN_Address(rtn), RTN_Name(rtn));
+    RTN_MAP[RTN_Address(rtn)] = rtn_info;
+    return rtn_info;
+}
+
+// Counts an iteration and returns whether the header was reached from outside the loop
+ADDRINT PIN_FAST_ANALYSIS_CALL header_is_entry(LOOP_INFO* loop) {
+    UINT64 back = loop->from_back_edge;
+    loop->from_back_edge = 0;
+    loop->CountSeen++;
+    loop->CURRENT_iterations_counter++;
+    return !back;
+}
 
-map<ADDRINT,LOOP_INFO> LOOP_MAP;;//KEY is ins address, VAL=LOOP_INFO[KEY]
-map<ADDRINT,UINT64> MAP_FOR_SORTING;
+// Closes the previous invocation of the loop, the current iteration already belongs to the new one
+VOID PIN_FAST_ANALYSIS_CALL loop_entry(LOOP_INFO* loop) {
+    UINT64 previous_trip = loop->CURRENT_iterations_counter - 1;
+    if (loop->CountLoopInvoked > 0 && previous_trip != loop->PREVIOUS_iterations_counter) {
+        loop->DiffCount++;
+    }
+    loop->PREVIOUS_iterations_counter = previous_trip;
+    loop->CURRENT_iterations_counter = 1;
+    loop->CountLoopInvoked++;
+}
 
-/*Inserts a new loop to the map and updates it*/
+VOID PIN_FAST_ANALYSIS_CALL back_edge(LOOP_INFO* loop) {
+    loop->from_back_edge = 1;
+}
 
-void inc_loop(INT32 taken, ADDRINT ins_addr) {
+VOID PIN_FAST_ANALYSIS_CALL loop_exit(LOOP_INFO* loop) {
+    loop->CountExits++;
+}
 
-    auto& loop_info = LOOP_MAP[ins_addr];
+// Splits the routine into basic blocks and connects the direct edges inside it
+void build_cfg(RTN rtn, vector<BLOCK_INFO>& blocks) {
+    set<ADDRINT> ins_addrs;
+    set<ADDRINT> leaders;
+    ADDRINT rtn_addr = RTN_Address(rtn);
+    leaders.insert(rtn_addr);
+    for (INS ins = RTN_InsHead(rtn); INS_Valid(ins); ins = INS_Next(ins)) {
+        ins_addrs.insert(INS_Address(ins));
+        if (!INS_IsControlFlow(ins) || INS_IsCall(ins))
+            continue;
+        if (INS_IsDirectControlFlow(ins))
+            leaders.insert(INS_DirectControlFlowTargetAddress(ins));
+        leaders.insert(INS_NextAddress(ins));
+    }
+    map<ADDRINT, UINT32> block_of;
+    for (INS ins = RTN_InsHead(rtn); INS_Valid(ins); ins = INS_Next(ins)) {
+        if (leaders.count(INS_Address(ins))) {
+            block_of[INS_Address(ins)] = blocks.size();
+            blocks.push_back(BLOCK_INFO(INS_Address(ins)));
+        }
+        blocks.back().tail = ins;
+    }
+    for (UINT32 id = 0; id < blocks.size(); id++) {
+        INS tail = blocks[id].tail;
+        vector<ADDRINT> targets;
+        if (INS_IsDirectControlFlow(tail) && !INS_IsCall(tail))
+            targets.push_back(INS_DirectControlFlowTargetAddress(tail));
+        if (!INS_IsControlFlow(tail) || INS_IsCall(tail) || INS_Category(tail) == XED_CATEGORY_COND_BR)
+            targets.push_back(INS_NextAddress(tail));
+        for (ADDRINT target : targets) {
+            // targets outside the routine or in the middle of an instruction are not edges
+            if (!ins_addrs.count(target))
+                continue;
+            UINT32 succ = block_of[target];
+            if (find(blocks[id].succs.begin(), blocks[id].succs.end(), succ) != blocks[id].succs.end())
+                continue;
+            blocks[id].succs.push_back(succ);
+            blocks[succ].preds.push_back(id);
+        }
+    }
+}
 
-    loop_info.CountSeen++;
-    MAP_FOR_SORTING[ins_addr]++; 
+void post_order(vector<BLOCK_INFO>& blocks, UINT32 id, vector<bool>& visited, vector<UINT32>& order) {
+    visited[id] = true;
+    for (UINT32 succ : blocks[id].succs) {
+        if (!visited[succ])
+            post_order(blocks, succ, visited, order);
+    }
+    order.push_back(id);
+}
 
-    if (taken) {
-        loop_info.CURRENT_iterations_counter++;
-        loop_info.previously_taken = true;
-    } else {
-        loop_info.CountLoopInvoked++;
-        loop_info.previously_taken = false;
+// Immediate dominators by the iterative algorithm of Cooper, Harvey and Kennedy.
+// Blocks that are not reachable from the entry (e.g. behind a jump table) get -1
+vector<INT32> find_dominators(vector<BLOCK_INFO>& blocks) {
+    vector<bool> visited(blocks.size(), false);
+    vector<UINT32> order;
+    post_order(blocks, 0, visited, order);
+    vector<UINT32> rank(blocks.size(), 0); // post order number
+    for (UINT32 i = 0; i < order.size(); i++)
+        rank[order[i]] = i;
 
-        if (loop_info.CountLoopInvoked > 0 &&
-            (loop_info.PREVIOUS_iterations_counter != loop_info.CURRENT_iterations_counter)) {
-            loop_info.DiffCount++;
+    vector<INT32> idom(blocks.size(), -1);
+    idom[0] = 0;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (auto it = order.rbegin(); it != order.rend(); ++it) {
+            UINT32 id = *it;
+            if (id == 0)
+                continue;
+            INT32 new_idom = -1;
+            for (UINT32 pred : blocks[id].preds) {
+                if (idom[pred] == -1)
+                    continue;
+                if (new_idom == -1) {
+                    new_idom = pred;
+                    continue;
+                }
+                UINT32 a = pred, b = new_idom;
+                while (a != b) {
+                    while (rank[a] < rank[b])
+                        a = idom[a];
+                    while (rank[b] < rank[a])
+                        b = idom[b];
+                }
+                new_idom = a;
+            }
+            if (idom[id] != new_idom) {
+                idom[id] = new_idom;
+                changed = true;
+            }
         }
+    }
+    return idom;
+}
 
-        loop_info.PREVIOUS_iterations_counter = loop_info.CURRENT_iterations_counter;
-        loop_info.CURRENT_iterations_counter = 0;
+bool dominates(vector<INT32>& idom, UINT32 a, UINT32 b) {
+    while (true) {
+        if (a == b)
+            return true;
+        if (b == 0 || idom[b] == -1)
+            return false;
+        b = idom[b];
     }
 }
 
-// Function to count the number of instructions executed
-VOID docount(ADDRINT rtn_addr) {
-    RTN_MAP[rtn_addr]++;
+// Function to count the number of instructions executed, called once per BBL
+VOID PIN_FAST_ANALYSIS_CALL docount(UINT64* counter, UINT32 ins_num) {
+    *counter += ins_num;
 }
 
 // Function to count the number of times a routine is called
-VOID docallcount(ADDRINT rtn_addr) {
-    RTN_COUNT_MAP[rtn_addr]++;
+VOID PIN_FAST_ANALYSIS_CALL docallcount(UINT64* counter) {
+    (*counter)++;
 }
 
-VOID Trace (TRACE trace, void *v) {
-    for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl)) {
-        INS ins = BBL_InsTail(bbl);
-        if (!INS_Valid(ins))
+// Inserts a call on the edge from block src to block dst
+void insert_edge_call(vector<BLOCK_INFO>& blocks, UINT32 src, UINT32 dst, AFUNPTR func, LOOP_INFO* loop) {
+    INS tail = blocks[src].tail;
+    IPOINT ipoint = IPOINT_BEFORE;
+    if (INS_IsBranch(tail) && INS_HasFallThrough(tail) && INS_IsDirectControlFlow(tail)
+        && INS_DirectControlFlowTargetAddress(tail) != INS_NextAddress(tail)) {
+        // a conditional branch, its other side may be another block or leave the routine
+        ipoint = (INS_DirectControlFlowTargetAddress(tail) == blocks[dst].start) ? IPOINT_TAKEN_BRANCH : IPOINT_AFTER;
+    }
+    INS_InsertCall(tail, ipoint, func, IARG_FAST_ANALYSIS_CALL, IARG_PTR, loop, IARG_END);
+}
+
+VOID Routine(RTN rtn, VOID *v) {
+    RTN_INFO* rtn_info = get_rtn_info(rtn);
+    RTN_Open(rtn);
+    RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR)docallcount, IARG_FAST_ANALYSIS_CALL, IARG_PTR, &(rtn_info->CallCount), IARG_END);
+    vector<BLOCK_INFO> blocks;
+    build_cfg(rtn, blocks);
+    vector<INT32> idom = find_dominators(blocks);
+
+    // one loop per header, its body is the union of the natural loops of the back edges into it
+    map<UINT32, vector<bool>> bodies;
+    map<UINT32, vector<UINT32>> latches;
+    for (UINT32 src = 0; src < blocks.size(); src++) {
+        if (idom[src] == -1)
             continue;
-        ADDRINT ins_addr = INS_Address(ins);
-        RTN ins_rtn = RTN_FindByAddress(ins_addr);
-        if (!RTN_Valid(ins_rtn))
+        for (UINT32 header : blocks[src].succs) {
+            if (!dominates(idom, header, src))
+                continue;
+            latches[header].push_back(src);
+            vector<bool>& body = bodies[header];
+            body.resize(blocks.size(), false);
+            body[header] = true;
+            vector<UINT32> work;
+            if (!body[src]) {
+                body[src] = true;
+                work.push_back(src);
+            }
+            while (!work.empty()) {
+                UINT32 id = work.back();
+                work.pop_back();
+                for (UINT32 pred : blocks[id].preds) {
+                    if (!body[pred] && idom[pred] != -1) {
+                        body[pred] = true;
+                        work.push_back(pred);
+                    }
+                }
+            }
+        }
+    }
+
+    map<UINT32, LOOP_INFO*> loops;
+    for (auto it = bodies.begin(); it != bodies.end();) {
+        if (NUM_LOOPS == MAX_LOOPS) {
+            std::cerr << "Too many loops, skipping the loop at 0x" << hex << blocks[it->first].start << dec << std::endl;
+            it = bodies.erase(it);
             continue;
-        ADDRINT rtn_addr = RTN_Address(ins_rtn);
-        // RTN_COUNT_MAP[rtn_addr]++; // Counts the number of routines 
-        string rtn_name = RTN_FindNameByAddress(ins_addr);
-        if (INS_IsDirectBranch(ins) && INS_IsControlFlow(ins)) { 
-            ADDRINT speculative_target_address = INS_DirectControlFlowTargetAddress(ins);
-            if (speculative_target_address < ins_addr) {
-                auto iter = LOOP_MAP.find(ins_addr);
-				if (iter == LOOP_MAP.end()) {
-					LOOP_MAP[ins_addr] = LOOP_INFO(0, speculative_target_address, rtn_addr, rtn_name, 0, 0, 0, 0, false);
-				}
-                INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR) inc_loop, IARG_BRANCH_TAKEN, IARG_ADDRINT, ins_addr,
-                               IARG_END);
+        }
+        LOOPS[NUM_LOOPS] = LOOP_INFO(blocks[it->first].start, rtn_info);
+        loops[it->first] = &LOOPS[NUM_LOOPS++];
+        ++it;
+    }
+    for (auto& outer : bodies) {
+        for (auto& inner : bodies) {
+            if (inner.first != outer.first && outer.second[inner.first])
+                loops[inner.first]->Depth++;
+        }
+    }
+
+    for (auto& it : bodies) {
+        UINT32 header = it.first;
+        LOOP_INFO* loop = loops[header];
+        INS header_ins = RTN_InsHead(rtn);
+        while (INS_Address(header_ins) != blocks[header].start)
+            header_ins = INS_Next(header_ins);
+        INS_InsertIfCall(header_ins, IPOINT_BEFORE, (AFUNPTR)header_is_entry, IARG_FAST_ANALYSIS_CALL, IARG_PTR, loop, IARG_END);
+        INS_InsertThenCall(header_ins, IPOINT_BEFORE, (AFUNPTR)loop_entry, IARG_FAST_ANALYSIS_CALL, IARG_PTR, loop, IARG_END);
+        for (UINT32 latch : latches[header])
+            insert_edge_call(blocks, latch, header, (AFUNPTR)back_edge, loop);
+        for (UINT32 src = 0; src < blocks.size(); src++) {
+            if (!it.second[src])
+                continue;
+            for (UINT32 dst : blocks[src].succs) {
+                if (!it.second[dst])
+                    insert_edge_call(blocks, src, dst, (AFUNPTR)loop_exit, loop);
             }
-		}
+        }
     }
+    RTN_Close(rtn);
 }
 
-VOID Instruction (INS ins, void *v)
-{
-    RTN ins_rtn = INS_Rtn(ins);
-    ADDRINT addr = INS_Address(ins);//DEBUG
-    if (ins_rtn == RTN_Invalid())
+VOID Trace(TRACE trace, void *v) {
+    RTN rtn = TRACE_Rtn(trace);
+    if (!RTN_Valid(rtn))
         return;
-    ADDRINT rtn_addr = RTN_Address(ins_rtn);
-    if (RTN_MAP.find(rtn_addr) == RTN_MAP.end()) {
-        RTN_MAP[rtn_addr] = 0;
+    RTN_INFO* rtn_info = get_rtn_info(rtn);
+    for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl)) {
+        BBL_InsertCall(bbl, IPOINT_BEFORE, (AFUNPTR)docount, IARG_FAST_ANALYSIS_CALL, IARG_PTR, &(rtn_info->InsCount),
+                       IARG_UINT32, BBL_NumIns(bbl), IARG_END);
     }
-    INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)docount, IARG_ADDRINT, rtn_addr, IARG_END);
-    if (addr == rtn_addr) { //DEBUG
-		INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)docallcount, IARG_ADDRINT, rtn_addr, IARG_END); //DEBUG
-	} //DEBUG 
-
 }
 
 
 VOID Fini(int n, void *v) {
-    /*sorting the map by Countseen*/
-    multimap <UINT64, LOOP_INFO> OUT_MAP;
-    for (map<ADDRINT, LOOP_INFO>::iterator it = LOOP_MAP.begin(); it != LOOP_MAP.end(); ++it) { 
-            OUT_MAP.insert(pair<UINT64, LOOP_INFO>((it->second).CountSeen, (it->second)));
-        }
+    /*sorting the loops by Countseen*/
+    sort(LOOPS, LOOPS + NUM_LOOPS, [](const LOOP_INFO& a, const LOOP_INFO& b) { return a.CountSeen > b.CountSeen; });
         /*opens a file:*/
 	std::ofstream file_pointer("loop-count.csv");
 	if (!file_pointer) {
 		std::cerr << "Can't open data file!" << std::endl;
 	}
 	double get_mean = 0;
-	multimap<UINT64, LOOP_INFO>::iterator it = OUT_MAP.end();
-	it--;
-	for ( ; it != OUT_MAP.begin(); --it) {
-		//ADDRINT iterator_key =it->first;
-		LOOP_INFO iterator_value = it->second; 
-		if (iterator_value.CountSeen == 0) {
+	for (UINT32 i = 0; i < NUM_LOOPS; i++) {
+		LOOP_INFO* loop = &LOOPS[i];
+		if (loop->CountSeen == 0) {
 			continue;
 		}
-		if (iterator_value.CountLoopInvoked > 0) {
-	    get_mean = (double) (iterator_value.CountSeen) /( iterator_value.CountLoopInvoked);
+		// close the last invocation
+		if (loop->CURRENT_iterations_counter != loop->PREVIOUS_iterations_counter) {
+			loop->DiffCount++;
 		}
-		iterator_value.DiffCount = iterator_value.DiffCount - 1;
-		// Printing!!
-		file_pointer << "0x" << hex << iterator_value.targetAddress << ", "
-				<< dec << iterator_value.CountSeen<< ", "
-				<< iterator_value.CountLoopInvoked<< ", "
-				<< get_mean << ", "<< dec <<iterator_value.DiffCount<< ", "<<iterator_value.RTN_Name<< ", "<< "0x" << hex << iterator_value.RTN_Address << ", "
-				<< dec <<RTN_MAP[iterator_value.RTN_Address]<< ", " << dec << RTN_COUNT_MAP[iterator_value.RTN_Address] << endl;
+		get_mean = (double) (loop->CountSeen) / (loop->CountLoopInvoked);
+		// Printing!! the columns after the routine call count are the loop depth and the exit count
+		file_pointer << "0x" << hex << loop->targetAddress << ", "
+				<< dec << loop->CountSeen<< ", "
+				<< loop->CountLoopInvoked<< ", "
+				<< get_mean << ", "<< dec <<loop->DiffCount - 1<< ", "<<loop->Rtn->Name<< ", "<< "0x" << hex << loop->Rtn->Address << ", "
+				<< dec <<loop->Rtn->InsCount<< ", " << dec << loop->Rtn->CallCount << ", "
+				<< loop->Depth << ", " << loop->CountExits << endl;
 	}
     file_pointer.close();
 }
 
 int ex2_main_prof()
 {
+    RTN_AddInstrumentFunction(Routine, 0);
     TRACE_AddInstrumentFunction(Trace, 0);
-    INS_AddInstrumentFunction(Instruction, 0);
     PIN_AddFiniFunction(Fini, 0);
 
     // Never returns
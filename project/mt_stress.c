@@ -0,0 +1,70 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/*
+ * Stress benchmark for the profiler on multithreaded targets.
+ * Every thread runs the same fixed amount of work through a few hot routines full of
+ * branches and calls, so with enough cores the elapsed time should stay flat as threads are added.
+ */
+
+#define ITERATIONS 20000000
+
+static __attribute__((noinline)) int bar(int x)
+{
+    if (x & 1) {
+        return x * 3 + 1;
+    }
+    return x / 2;
+}
+
+static __attribute__((noinline)) int foo(int x)
+{
+    int r = 0;
+    for (int i = 0; i < 4; i++) {
+        if (x > i) {
+            r += bar(x + i);
+        } else {
+            r -= i;
+        }
+    }
+    return r;
+}
+
+static void* worker(void* arg)
+{
+    long sum = 0;
+    for (int i = 0; i < ITERATIONS; i++) {
+        sum += foo(i & 0xff);
+    }
+    *(long*)arg = sum;
+    return NULL;
+}
+
+int main(int argc, char* argv[])
+{
+    int threads = (argc > 1) ? atoi(argv[1]) : 1;
+    if (threads <= 0) {
+        fprintf(stderr, "usage: %s [threads]\n", argv[0]);
+        return 1;
+    }
+    pthread_t* tids = malloc(threads * sizeof(pthread_t));
+    long* sums = malloc(threads * sizeof(long));
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&tids[i], NULL, worker, &sums[i]);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("threads=%d elapsed=%.3fs checksum=%ld\n", threads, elapsed, sums[0]);
+    free(tids);
+    free(sums);
+    return 0;
+}
@@ -0,0 +1,236 @@
+#include "src/profile_bin.h"
+#include <fcntl.h>
+#include <fstream>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Converts between profile.bin and the csv files of the profiler, in the current directory.
+ * -to_csv writes profile_stat.csv, profile_branches.csv, profile_calls.csv, profile_edges.csv, profile_cycles.csv,
+ * profile_fingerprints.csv (block offset, size, opcode hash) and profile_image.csv (build-id , image base address), -to_bin reads the same files (only profile_stat.csv
+ * is required) and writes profile.bin.
+ * usage: profile_convert.out -to_csv|-to_bin [profile.bin]
+ */
+
+#define STAT_CSV "profile_stat.csv"
+#define BRANCH_CSV "profile_branches.csv"
+#define CALL_CSV "profile_calls.csv"
+#define EDGE_CSV "profile_edges.csv"
+#define CYCLES_CSV "profile_cycles.csv"
+#define IMAGE_CSV "profile_image.csv"
+#define FINGERPRINT_CSV "profile_fingerprints.csv"
+
+static void usage()
+{
+    fprintf(stderr, "usage: profile_convert.out -to_csv|-to_bin [profile.bin]\n");
+    exit(1);
+}
+
+static const char* edge_kind_name(char kind)
+{
+    switch (kind) {
+    case 'T':
+        return "T";
+    case 'J':
+        return "J";
+    default:
+        return "F";
+    }
+}
+
+static int to_csv(const char* bin_name)
+{
+    int fd = open(bin_name, O_RDONLY);
+    struct stat file_stat;
+    if (fd < 0 || fstat(fd, &file_stat) != 0) {
+        fprintf(stderr, "Error: cannot open %s\n", bin_name);
+        return 1;
+    }
+    size_t file_size = file_stat.st_size;
+    void* addr = (file_size != 0) ? mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (addr == MAP_FAILED) {
+        fprintf(stderr, "Error: cannot map %s\n", bin_name);
+        return 1;
+    }
+    const char* base = (const char*)addr;
+    const profile_bin_header* header = (const profile_bin_header*)base;
+    if (!profile_bin_valid(header, file_size)) {
+        fprintf(stderr, "Error: %s is not a version %d profile\n", bin_name, PROFILE_BIN_VERSION);
+        return 1;
+    }
+    const profile_bin_rtn* rtns = (const profile_bin_rtn*)(base + header->rtns_off);
+    const profile_bin_branch* branches = (const profile_bin_branch*)(base + header->branches_off);
+    const profile_bin_call* calls = (const profile_bin_call*)(base + header->calls_off);
+    const profile_bin_block* blocks = (const profile_bin_block*)(base + header->blocks_off);
+    const profile_bin_edge* edges = (const profile_bin_edge*)(base + header->edges_off);
+    const profile_bin_block_hash* hashes = (const profile_bin_block_hash*)(base + header->hashes_off);
+    const char* strings = base + header->strings_off;
+
+    FILE* stat_file = fopen(STAT_CSV, "w");
+    FILE* branch_file = fopen(BRANCH_CSV, "w");
+    FILE* call_file = fopen(CALL_CSV, "w");
+    FILE* edge_file = fopen(EDGE_CSV, "w");
+    FILE* cycles_file = fopen(CYCLES_CSV, "w");
+    FILE* image_file = fopen(IMAGE_CSV, "w");
+    FILE* fingerprint_file = fopen(FINGERPRINT_CSV, "w");
+    if (!stat_file || !branch_file || !call_file || !edge_file || !cycles_file || !image_file || !fingerprint_file) {
+        fprintf(stderr, "Error: opening a file\n");
+        return 1;
+    }
+    fprintf(image_file, "%s,0x%lx\n", strings + header->build_id, (unsigned long)header->image_base);
+    fclose(image_file);
+    for (uint32_t i = 0; i < header->num_rtns; i++) {
+        const profile_bin_rtn* rtn = &rtns[i];
+        if (!profile_bin_rtn_valid(header, rtn)) {
+            fprintf(stderr, "Warning: skipping a malformed routine record\n");
+            continue;
+        }
+        const char* name = strings + rtn->name;
+        fprintf(stat_file, "%s,0x%lx,%lu,%hu,%u,%u,%s\n", name, (unsigned long)rtn->addr, (unsigned long)rtn->heat,
+            rtn->opt_mode, rtn->branch_offset, rtn->inline_offset, strings + rtn->inline_callee_name);
+        for (uint32_t j = rtn->first_branch; j < rtn->first_branch + rtn->num_branches; j++) {
+            fprintf(branch_file, "%s,%u,%lu,%lu,%lu\n", name, branches[j].offset, (unsigned long)branches[j].count,
+                (unsigned long)branches[j].taken, (unsigned long)branches[j].mispredicts);
+        }
+        for (uint32_t j = rtn->first_call; j < rtn->first_call + rtn->num_calls; j++) {
+            fprintf(call_file, "%s,%u,0x%lx,%lu\n", name, calls[j].offset, (unsigned long)calls[j].callee_addr,
+                (unsigned long)calls[j].count);
+        }
+        for (uint32_t j = 0; j < rtn->num_blocks; j++) {
+            const profile_bin_block* block = &blocks[rtn->first_block + j];
+            fprintf(edge_file, "%s,block,%u,%u,%u,%lu\n", name, j, block->start_offset, block->tail_offset, (unsigned long)block->count);
+        }
+        for (uint32_t j = rtn->first_edge; j < rtn->first_edge + rtn->num_edges; j++) {
+            fprintf(edge_file, "%s,edge,%u,%u,%s,%lu\n", name, edges[j].src, edges[j].dst, edge_kind_name(edges[j].kind),
+                (unsigned long)edges[j].count);
+        }
+        for (uint32_t j = rtn->first_hash; j < rtn->first_hash + rtn->num_hashes; j++) {
+            fprintf(fingerprint_file, "%s,%u,%u,0x%x\n", name, hashes[j].offset, hashes[j].size, hashes[j].hash);
+        }
+        if (rtn->incl_cycles || rtn->excl_cycles) {
+            fprintf(cycles_file, "%s,%lu,%lu\n", name, (unsigned long)rtn->incl_cycles, (unsigned long)rtn->excl_cycles);
+        }
+    }
+    fclose(stat_file);
+    fclose(branch_file);
+    fclose(call_file);
+    fclose(edge_file);
+    fclose(cycles_file);
+    fclose(fingerprint_file);
+    munmap(addr, file_size);
+    return 0;
+}
+
+// Reads the rows of an optional csv file, keyed by the routine name in the first field
+static void read_rows(const char* file_name, std::unordered_map<std::string, std::vector<std::string>>& rows)
+{
+    std::ifstream file(file_name);
+    std::string line;
+    while (std::getline(file, line)) {
+        rows[line.substr(0, line.find(','))].push_back(line);
+    }
+}
+
+static int to_bin(const char* bin_name)
+{
+    std::ifstream stat_file(STAT_CSV);
+    if (!stat_file.is_open()) {
+        fprintf(stderr, "Error: %s not found\n", STAT_CSV);
+        return 1;
+    }
+    std::unordered_map<std::string, std::vector<std::string>> branch_rows, call_rows, edge_rows, cycle_rows, fingerprint_rows;
+    read_rows(BRANCH_CSV, branch_rows);
+    read_rows(CALL_CSV, call_rows);
+    read_rows(EDGE_CSV, edge_rows);
+    read_rows(CYCLES_CSV, cycle_rows);
+    read_rows(FINGERPRINT_CSV, fingerprint_rows);
+
+    profile_bin_builder builder;
+    std::string line, name, field;
+    // Without profile_image.csv the profile has no build-id and -opt matches the routines by name
+    std::ifstream image_file(IMAGE_CSV);
+    if (std::getline(image_file, line)) {
+        builder.build_id = line.substr(0, line.find(','));
+        builder.image_base = strtoull(line.c_str() + builder.build_id.size() + 1, NULL, 16);
+    }
+    while (std::getline(stat_file, line)) {
+        std::stringstream s_stream(line);
+        std::getline(s_stream, name, ',');
+        std::getline(s_stream, field, ',');
+        profile_bin_rtn* rtn = builder.add_rtn(name, strtoull(field.c_str(), NULL, 16));
+        std::getline(s_stream, field, ',');
+        rtn->heat = strtoull(field.c_str(), NULL, 10);
+        std::getline(s_stream, field, ',');
+        rtn->opt_mode = strtoul(field.c_str(), NULL, 10);
+        std::getline(s_stream, field, ',');
+        rtn->branch_offset = strtoul(field.c_str(), NULL, 10);
+        std::getline(s_stream, field, ',');
+        rtn->inline_offset = strtoul(field.c_str(), NULL, 10);
+        std::getline(s_stream, field);
+        rtn->inline_callee_name = builder.add_string(field);
+        for (const std::string& row : cycle_rows[name]) {
+            unsigned long incl, excl;
+            if (sscanf(row.c_str() + name.size(), ",%lu,%lu", &incl, &excl) == 2) {
+                rtn->incl_cycles = incl;
+                rtn->excl_cycles = excl;
+            }
+        }
+        for (const std::string& row : branch_rows[name]) {
+            unsigned int offset;
+            unsigned long count, taken, mispredicts;
+            if (sscanf(row.c_str() + name.size(), ",%u,%lu,%lu,%lu", &offset, &count, &taken, &mispredicts) == 4) {
+                builder.add_branch(offset, count, taken, mispredicts);
+            }
+        }
+        for (const std::string& row : call_rows[name]) {
+            unsigned int offset;
+            unsigned long callee_addr, count;
+            if (sscanf(row.c_str() + name.size(), ",%u,%lx,%lu", &offset, &callee_addr, &count) == 3) {
+                builder.add_call(offset, callee_addr, count);
+            }
+        }
+        for (const std::string& row : edge_rows[name]) {
+            unsigned int a, b, c;
+            unsigned long count;
+            char kind;
+            if (sscanf(row.c_str() + name.size(), ",block,%u,%u,%u,%lu", &a, &b, &c, &count) == 4) {
+                builder.add_block(b, c, count);
+            } else if (sscanf(row.c_str() + name.size(), ",edge,%u,%u,%c,%lu", &a, &b, &kind, &count) == 4) {
+                builder.add_edge(a, b, kind, count);
+            }
+        }
+        for (const std::string& row : fingerprint_rows[name]) {
+            unsigned int offset, size, hash;
+            if (sscanf(row.c_str() + name.size(), ",%u,%u,%x", &offset, &size, &hash) == 3) {
+                builder.add_block_hash(offset, size, hash);
+            }
+        }
+    }
+    if (!builder.write(bin_name)) {
+        fprintf(stderr, "Error: writing %s\n", bin_name);
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2 || argc > 3) {
+        usage();
+    }
+    const char* bin_name = (argc == 3) ? argv[2] : "profile.bin";
+    if (strcmp(argv[1], "-to_csv") == 0) {
+        return to_csv(bin_name);
+    }
+    if (strcmp(argv[1], "-to_bin") == 0) {
+        return to_bin(bin_name);
+    }
+    usage();
+    return 1;
+}
@@ -0,0 +1,192 @@
+#include "src/profile_merge.h"
+#include <fstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+
+/*
+ * Merges the profile.bin files of several runs of the same executable into one profile.bin.
+ * Every input is scaled by its weight (file:weight, 1 by default) and with -normalize also by the mean
+ * instruction count of the inputs over its own, so every run weighs the same whatever its length.
+ * The routine, branch, call, block and edge counts are summed, and the reorder and inline candidates
+ * are picked again from the merged branch and call counts, with the same rules as -prof.
+ * The inputs are read in parallel by -j threads (all cores by default).
+ * usage: profile_merge.out [-o profile.bin] [-j threads] [-normalize] [-list file] input.bin[:weight] ...
+ */
+
+struct merge_input {
+    std::string file_name;
+    double weight;
+    const char* base; // mapped file, nullptr if it could not be read
+    size_t file_size;
+    double scale; // weight, times the normalization factor
+};
+
+static void usage()
+{
+    fprintf(stderr, "usage: profile_merge.out [-o profile.bin] [-j threads] [-normalize] [-list file] input.bin[:weight] ...\n");
+    exit(1);
+}
+
+// Splits an optional :weight suffix off the file name
+static bool add_input(std::vector<merge_input>& inputs, const std::string& arg)
+{
+    merge_input input = { arg, 1.0, nullptr, 0, 1.0 };
+    size_t colon = arg.rfind(':');
+    if (colon != std::string::npos) {
+        char* end;
+        double weight = strtod(arg.c_str() + colon + 1, &end);
+        if (*end == '\0' && end != arg.c_str() + colon + 1) {
+            if (weight < 0) {
+                fprintf(stderr, "Error: negative weight in %s\n", arg.c_str());
+                return false;
+            }
+            input.file_name = arg.substr(0, colon);
+            input.weight = weight;
+        }
+    }
+    inputs.push_back(input);
+    return true;
+}
+
+// Reads a list file, one input.bin[:weight] per line
+static bool read_list(std::vector<merge_input>& inputs, const char* list_name)
+{
+    std::ifstream list_file(list_name);
+    if (!list_file.is_open()) {
+        fprintf(stderr, "Error: %s not found\n", list_name);
+        return false;
+    }
+    std::string line;
+    while (std::getline(list_file, line)) {
+        if (!line.empty() && !add_input(inputs, line)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void map_input(merge_input* input)
+{
+    input->base = map_profile_bin(input->file_name.c_str(), &input->file_size);
+}
+
+static uint64_t total_heat(const merge_input* input)
+{
+    const profile_bin_header* header = (const profile_bin_header*)input->base;
+    const profile_bin_rtn* rtns = (const profile_bin_rtn*)(input->base + header->rtns_off);
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < header->num_rtns; i++) {
+        total += rtns[i].heat;
+    }
+    return total;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* out_name = "profile.bin";
+    unsigned int num_threads = std::thread::hardware_concurrency();
+    bool normalize = false;
+    std::vector<merge_input> inputs;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            out_name = argv[++i];
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            num_threads = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-normalize") == 0) {
+            normalize = true;
+        } else if (strcmp(argv[i], "-list") == 0 && i + 1 < argc) {
+            if (!read_list(inputs, argv[++i])) {
+                return 1;
+            }
+        } else if (argv[i][0] == '-') {
+            usage();
+        } else if (!add_input(inputs, argv[i])) {
+            return 1;
+        }
+    }
+    if (inputs.empty()) {
+        usage();
+    }
+    num_threads = std::max(1u, std::min<unsigned int>(num_threads, inputs.size()));
+
+    // Every thread maps its share of the inputs
+    std::vector<std::thread> threads;
+    for (unsigned int t = 0; t < num_threads; t++) {
+        threads.emplace_back([&inputs, t, num_threads]() {
+            for (size_t i = t; i < inputs.size(); i += num_threads) {
+                map_input(&inputs[i]);
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    // All inputs must come from one build, the first valid input sets it
+    const profile_bin_header* first = nullptr;
+    std::vector<uint64_t> heats(inputs.size(), 0);
+    double mean_heat = 0;
+    size_t num_valid = 0;
+    for (size_t i = 0; i < inputs.size(); i++) {
+        if (inputs[i].base == nullptr) {
+            continue;
+        }
+        const profile_bin_header* header = (const profile_bin_header*)inputs[i].base;
+        if (first == nullptr) {
+            first = header;
+        } else if (strcmp(profile_bin_build_id(inputs[i].base), profile_bin_build_id((const char*)first)) != 0) {
+            fprintf(stderr, "Error: %s was recorded on build-id %s, the other inputs on %s\n", inputs[i].file_name.c_str(),
+                profile_bin_build_id(inputs[i].base), profile_bin_build_id((const char*)first));
+            return 1;
+        }
+        heats[i] = total_heat(&inputs[i]);
+        mean_heat += heats[i];
+        num_valid++;
+    }
+    if (first == nullptr) {
+        fprintf(stderr, "Error: no valid input profile\n");
+        return 1;
+    }
+    mean_heat /= num_valid;
+    for (size_t i = 0; i < inputs.size(); i++) {
+        inputs[i].scale = inputs[i].weight;
+        if (normalize && heats[i] != 0) {
+            inputs[i].scale *= mean_heat / heats[i];
+        }
+    }
+
+    // Every thread merges its share of the inputs into its own partial profile
+    std::vector<merged_profile> partials(num_threads);
+    threads.clear();
+    for (unsigned int t = 0; t < num_threads; t++) {
+        threads.emplace_back([&inputs, &partials, t, num_threads]() {
+            for (size_t i = t; i < inputs.size(); i += num_threads) {
+                if (inputs[i].base != nullptr) {
+                    merge_profile_bin(partials[t], inputs[i].base, inputs[i].scale, inputs[i].file_name.c_str());
+                }
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    for (unsigned int t = 1; t < num_threads; t++) {
+        merge_profiles(partials[0], partials[t]);
+    }
+
+    std::string build_id = profile_bin_build_id((const char*)first);
+    bool written = write_merged(partials[0], build_id, first->image_base, out_name);
+    for (merge_input& input : inputs) {
+        if (input.base != nullptr) {
+            munmap((void*)input.base, input.file_size);
+        }
+    }
+    if (!written) {
+        fprintf(stderr, "Error: writing %s\n", out_name);
+        return 1;
+    }
+    printf("merged %zu of %zu profiles into %s\n", num_valid, inputs.size(), out_name);
+    return 0;
+}
@@ -0,0 +1,111 @@
+#include "pin.H"
+#include "prof_rtn_stat.h"
+#include "profile.h"
+#include <cstdio>
+#include <iostream>
+#include <stdlib.h>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+using std::cerr;
+using std::endl;
+using std::pair;
+using std::unordered_set;
+using std::vector;
+
+#define MIN_BP_HISTORY 1
+#define MAX_BP_HISTORY 24 // three tables of 16M entries
+
+KNOB<BOOL> prof_bp_knob(KNOB_MODE_WRITEONCE, "pintool", "prof_bp", "0", "simulate a gshare and bimodal branch predictor on the main executable branches and save the mispredictions to the file profile_branches.csv");
+KNOB<UINT32> prof_bp_history_knob(KNOB_MODE_WRITEONCE, "pintool", "prof_bp_history", "12", "global history length of the simulated gshare predictor, its tables have 2^length entries");
+
+// Tournament of a gshare predictor (global history xor pc) and a bimodal predictor (pc),
+// a chooser table indexed by pc learns which of the two to trust for every branch.
+// All of the tables hold 2 bit saturating counters, the predictor state is shared by the threads
+static UINT8* gshare_table;
+static UINT8* bimodal_table;
+static UINT8* chooser_table; // >= 2 picks gshare
+static UINT64 global_history;
+static UINT64 table_mask;
+static vector<pair<rtn_stat*, branch_stat*>> predicted_branches;
+static unordered_set<branch_stat*> predicted_branch_set;
+
+static inline VOID train_counter(UINT8* counter, BOOL taken)
+{
+    if (taken) {
+        *counter += (*counter < 3);
+    } else {
+        *counter -= (*counter > 0);
+    }
+}
+
+VOID predict_branch(branch_stat* branch, ADDRINT pc, BOOL taken)
+{
+    UINT8* gshare = &gshare_table[(global_history ^ pc) & table_mask];
+    UINT8* bimodal = &bimodal_table[pc & table_mask];
+    UINT8* chooser = &chooser_table[pc & table_mask];
+    bool gshare_taken = (*gshare >= 2);
+    bool bimodal_taken = (*bimodal >= 2);
+    bool predicted_taken = (*chooser >= 2) ? gshare_taken : bimodal_taken;
+
+    branch->mispredicts += (predicted_taken != (bool)taken);
+    // The chooser only learns when the two predictors disagree
+    if (gshare_taken != bimodal_taken) {
+        train_counter(chooser, gshare_taken == (bool)taken);
+    }
+    train_counter(gshare, taken);
+    train_counter(bimodal, taken);
+    global_history = (global_history << 1) | (taken ? 1 : 0);
+}
+
+bool init_branch_predictor()
+{
+    if (prof_bp_history_knob < MIN_BP_HISTORY || prof_bp_history_knob > MAX_BP_HISTORY) {
+        cerr << "Error: -prof_bp_history must be between " << MIN_BP_HISTORY << " and " << MAX_BP_HISTORY << endl;
+        return false;
+    }
+    UINT64 entries = 1ULL << prof_bp_history_knob.Value();
+    table_mask = entries - 1;
+    gshare_table = new UINT8[entries];
+    bimodal_table = new UINT8[entries];
+    chooser_table = new UINT8[entries];
+    for (UINT64 i = 0; i < entries; i++) {
+        // weakly not taken, and no preference between the predictors
+        gshare_table[i] = 1;
+        bimodal_table[i] = 1;
+        chooser_table[i] = 2;
+    }
+    global_history = 0;
+    return true;
+}
+
+// The predictor sees every execution of the branch, it is not sampled
+VOID instrument_branch_predictor(INS ins, rtn_stat* stat, branch_stat* branch)
+{
+    if (predicted_branch_set.insert(branch).second) {
+        predicted_branches.push_back({ stat, branch });
+    }
+    INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)predict_branch, IARG_PTR, branch, IARG_INST_PTR, IARG_BRANCH_TAKEN, IARG_END);
+}
+
+// One row per predicted branch: routine name,branch offset,count,taken count,mispredictions
+VOID write_branch_profile()
+{
+    FILE* file_ptr = fopen(BRANCH_FILE_NAME, "w");
+    if (file_ptr == NULL) {
+        cerr << "Error: opening a file" << endl;
+        return;
+    }
+    for (auto it = predicted_branches.begin(); it != predicted_branches.end(); ++it) {
+        rtn_stat* stat = it->first;
+        branch_stat* branch = it->second;
+        fprintf(file_ptr, "%s,%lu,%lu,%lu,%lu\n",
+            stat->rtn_name.c_str(),
+            branch->branch_addr - stat->rtn_addr,
+            branch->branch_count,
+            branch->branch_taken,
+            branch->mispredicts);
+    }
+    fclose(file_ptr);
+}
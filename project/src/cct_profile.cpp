@@ -0,0 +1,155 @@
+#include "pin.H"
+#include "prof_rtn_stat.h"
+#include "profile.h"
+#include <cstdio>
+#include <iostream>
+#include <map>
+#include <stdlib.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using std::cerr;
+using std::endl;
+using std::map;
+using std::string;
+using std::unordered_map;
+using std::vector;
+
+KNOB<BOOL> prof_cct_knob(KNOB_MODE_WRITEONCE, "pintool", "prof_cct", "0", "build a calling context tree of the main executable routines, save its folded stacks to the file profile_cct.folded and pick the inline candidates by context heat");
+
+// A node of the calling context tree, one per routine and call site on the path from the thread's root
+struct cct_node {
+    rtn_stat* stat; // nullptr for the root of a thread
+    cct_node* parent;
+    ADDRINT ret_addr; // return address of the call site in the parent
+    UINT64 ins_count; // instructions executed in this context, without the callees
+    UINT64 call_count;
+    vector<cct_node*> children;
+
+    cct_node(rtn_stat* stat, cct_node* parent, ADDRINT ret_addr)
+        : stat(stat)
+        , parent(parent)
+        , ret_addr(ret_addr)
+        , ins_count(0)
+        , call_count(0)
+        , children()
+    {
+    }
+};
+
+// The nodes belong to their thread, so only the list of roots is shared
+static vector<cct_node*> cct_roots;
+static PIN_LOCK cct_roots_lock;
+static unordered_map<ADDRINT, UINT64> cct_site_heat; // return address of a call site -> callee instructions in that context
+
+VOID cct_thread_start(thread_state* state, THREADID tid)
+{
+    cct_node* root = new cct_node(nullptr, nullptr, 0);
+    state->cct_stack.push_back(cct_frame(root, ~(ADDRINT)0));
+    PIN_GetLock(&cct_roots_lock, tid + 1);
+    cct_roots.push_back(root);
+    PIN_ReleaseLock(&cct_roots_lock);
+}
+
+// Frames at or below the stack pointer of a routine entry or return are dead,
+// they were left by a tail call or a longjmp if they were not popped by their own return
+static inline VOID pop_dead_frames(thread_state* state, ADDRINT sp)
+{
+    while (state->cct_stack.size() > 1 && state->cct_stack.back().sp <= sp) {
+        state->cct_stack.pop_back();
+    }
+}
+
+VOID cct_enter(thread_state* state, rtn_stat* stat, ADDRINT sp, ADDRINT ret_addr)
+{
+    pop_dead_frames(state, sp);
+    cct_node* parent = state->cct_stack.back().node;
+    cct_node* node = nullptr;
+    for (auto it = parent->children.begin(); it != parent->children.end(); ++it) {
+        if ((*it)->stat == stat && (*it)->ret_addr == ret_addr) {
+            node = *it;
+            break;
+        }
+    }
+    if (node == nullptr) {
+        node = new cct_node(stat, parent, ret_addr);
+        parent->children.push_back(node);
+    }
+    node->call_count++;
+    state->cct_stack.push_back(cct_frame(node, sp));
+}
+
+VOID cct_return(thread_state* state, ADDRINT sp)
+{
+    pop_dead_frames(state, sp);
+}
+
+VOID PIN_FAST_ANALYSIS_CALL cct_ins_count(thread_state* state, UINT32 c)
+{
+    state->cct_stack.back().node->ins_count += c;
+}
+
+VOID init_cct_profile()
+{
+    PIN_InitLock(&cct_roots_lock);
+}
+
+VOID instrument_rtn_cct(RTN rtn, rtn_stat* stat)
+{
+    RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR)cct_enter, IARG_REG_VALUE, thread_state_reg, IARG_PTR, stat,
+        IARG_REG_VALUE, REG_STACK_PTR, IARG_RETURN_IP, IARG_END);
+    for (INS ins = RTN_InsHead(rtn); INS_Valid(ins); ins = INS_Next(ins)) {
+        if (INS_IsRet(ins)) {
+            INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)cct_return, IARG_REG_VALUE, thread_state_reg,
+                IARG_REG_VALUE, REG_STACK_PTR, IARG_END);
+        }
+    }
+}
+
+VOID instrument_bbl_cct(BBL bbl)
+{
+    BBL_InsertCall(bbl, IPOINT_BEFORE, (AFUNPTR)cct_ins_count, IARG_FAST_ANALYSIS_CALL,
+        IARG_REG_VALUE, thread_state_reg, IARG_UINT32, BBL_NumIns(bbl), IARG_END);
+}
+
+// Folds the subtree into "caller;callee count" lines and sums the callee instructions of every call site
+static VOID fold_cct_node(cct_node* node, const string& stack, map<string, UINT64>& folded)
+{
+    for (auto it = node->children.begin(); it != node->children.end(); ++it) {
+        cct_node* child = *it;
+        string child_stack = stack.empty() ? child->stat->rtn_name : stack + ";" + child->stat->rtn_name;
+        if (child->ins_count) {
+            folded[child_stack] += child->ins_count;
+        }
+        if (node->stat != nullptr) {
+            cct_site_heat[child->ret_addr] += child->ins_count;
+        }
+        fold_cct_node(child, child_stack, folded);
+    }
+}
+
+// Has to run before the inline candidates are picked
+VOID fold_cct_profile()
+{
+    map<string, UINT64> folded; // the threads with the same stacks are merged here
+    for (auto it = cct_roots.begin(); it != cct_roots.end(); ++it) {
+        fold_cct_node(*it, "", folded);
+    }
+    FILE* file_ptr = fopen(CCT_FILE_NAME, "w");
+    if (file_ptr == NULL) {
+        cerr << "Error: opening a file" << endl;
+        return;
+    }
+    // flamegraph.pl reads one stack per line, the frames separated by ';' and the count after a space
+    for (auto it = folded.begin(); it != folded.end(); ++it) {
+        fprintf(file_ptr, "%s %lu\n", it->first.c_str(), it->second);
+    }
+    fclose(file_ptr);
+}
+
+UINT64 cct_call_site_heat(ADDRINT ret_addr)
+{
+    auto it = cct_site_heat.find(ret_addr);
+    return (it == cct_site_heat.end()) ? 0 : it->second;
+}
@@ -0,0 +1,170 @@
+#include "pin.H"
+#include "prof_rtn_stat.h"
+#include "profile.h"
+#include <cstdio>
+#include <iostream>
+#include <stdlib.h>
+#include <unordered_map>
+#include <vector>
+
+using std::cerr;
+using std::endl;
+using std::unordered_map;
+using std::vector;
+
+#define DELINQUENT_MISS_RATIO 0.1 // share of the executions of a load that miss the L1
+#define STABLE_STRIDE_RATIO 0.5 // share of the executions of a load that repeat the previous stride
+#define MAX_PREFETCH_ITERATIONS 16
+
+KNOB<BOOL> prof_dcache_knob(KNOB_MODE_WRITEONCE, "pintool", "prof_dcache", "0", "simulate an L1 and an LLC data cache on the main executable memory accesses and save the delinquent loads to the file profile_loads.csv");
+KNOB<UINT32> prof_l1_size_knob(KNOB_MODE_WRITEONCE, "pintool", "prof_l1_size", "32768", "simulated L1 data cache size in bytes");
+KNOB<UINT32> prof_l1_assoc_knob(KNOB_MODE_WRITEONCE, "pintool", "prof_l1_assoc", "8", "simulated L1 data cache associativity");
+KNOB<UINT32> prof_llc_size_knob(KNOB_MODE_WRITEONCE, "pintool", "prof_llc_size", "2097152", "simulated last level cache size in bytes");
+KNOB<UINT32> prof_llc_assoc_knob(KNOB_MODE_WRITEONCE, "pintool", "prof_llc_assoc", "16", "simulated last level cache associativity");
+KNOB<UINT32> prof_dcache_line_knob(KNOB_MODE_WRITEONCE, "pintool", "prof_dcache_line", "64", "simulated data cache line size in bytes");
+KNOB<UINT32> prof_miss_latency_knob(KNOB_MODE_WRITEONCE, "pintool", "prof_miss_latency", "200", "instructions a prefetch has to run ahead of its load to hide a miss");
+
+// Miss and stride statistics of a load instruction
+struct load_stat {
+    rtn_stat* stat;
+    ADDRINT ins_addr;
+    UINT64 count;
+    UINT64 l1_misses;
+    UINT64 llc_misses;
+    ADDRINT last_addr;
+    ADDRINT last_stride;
+    ADDRINT repeated_stride; // the stride that repeats most, picked by a majority vote over the repeats
+    UINT64 stride_votes;
+    UINT64 stride_repeats; // executions that repeated repeated_stride since it was picked
+
+    load_stat(rtn_stat* stat, ADDRINT ins_addr)
+        : stat(stat)
+        , ins_addr(ins_addr)
+        , count(0)
+        , l1_misses(0)
+        , llc_misses(0)
+        , last_addr(0)
+        , last_stride(0)
+        , repeated_stride(0)
+        , stride_votes(0)
+        , stride_repeats(0)
+    {
+    }
+};
+
+static sim_cache* l1_cache;
+static sim_cache* llc_cache;
+static vector<load_stat*> load_list;
+static unordered_map<ADDRINT, load_stat*> load_map; // load instruction address -> its statistics
+
+VOID dcache_load(load_stat* load, ADDRINT addr)
+{
+    load->count++;
+    ADDRINT stride = addr - load->last_addr;
+    if (stride == load->last_stride) {
+        if (stride == load->repeated_stride) {
+            load->stride_votes++;
+            load->stride_repeats++;
+        } else if (load->stride_votes == 0) {
+            load->repeated_stride = stride;
+            load->stride_votes = 1;
+            load->stride_repeats = 1;
+        } else {
+            load->stride_votes--;
+        }
+    }
+    load->last_stride = stride;
+    load->last_addr = addr;
+    if (l1_cache->access(addr)) {
+        return;
+    }
+    load->l1_misses++;
+    if (!llc_cache->access(addr)) {
+        load->llc_misses++;
+    }
+}
+
+// Stores only bring their line in (write allocate)
+VOID dcache_store(ADDRINT addr)
+{
+    if (!l1_cache->access(addr)) {
+        llc_cache->access(addr);
+    }
+}
+
+VOID init_dcache_sim()
+{
+    l1_cache = new sim_cache(prof_l1_size_knob.Value(), prof_l1_assoc_knob.Value(), prof_dcache_line_knob.Value());
+    llc_cache = new sim_cache(prof_llc_size_knob.Value(), prof_llc_assoc_knob.Value(), prof_dcache_line_knob.Value());
+}
+
+// The simulated caches are shared by the threads and see every access, they are not sampled
+VOID instrument_dcache(INS ins, rtn_stat* stat)
+{
+    if (!INS_IsStandardMemop(ins) || INS_IsPrefetch(ins)) {
+        return;
+    }
+    if (INS_IsMemoryRead(ins)) {
+        load_stat* load;
+        auto it = load_map.find(INS_Address(ins));
+        if (it != load_map.end()) {
+            load = it->second;
+        } else {
+            load = new load_stat(stat, INS_Address(ins));
+            load_map[INS_Address(ins)] = load;
+            load_list.push_back(load);
+        }
+        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)dcache_load, IARG_PTR, load, IARG_MEMORYREAD_EA, IARG_END);
+    }
+    if (INS_IsMemoryWrite(ins)) {
+        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)dcache_store, IARG_MEMORYWRITE_EA, IARG_END);
+    }
+}
+
+// A prefetch has to be issued enough iterations ahead to cover the miss latency, an iteration is estimated
+// as the instructions the routine runs per execution of the load
+static UINT64 prefetch_distance(load_stat* load)
+{
+    UINT64 ins_per_iteration = load->stat->ins_count / load->count;
+    if (ins_per_iteration == 0) {
+        ins_per_iteration = 1;
+    }
+    UINT64 iterations = (prof_miss_latency_knob.Value() + ins_per_iteration - 1) / ins_per_iteration;
+    if (iterations > MAX_PREFETCH_ITERATIONS) {
+        iterations = MAX_PREFETCH_ITERATIONS;
+    }
+    return iterations;
+}
+
+// One row per delinquent load with a stable stride:
+// routine name,load offset,count,l1 misses,llc misses,stride,prefetch distance in bytes
+VOID write_load_profile()
+{
+    FILE* file_ptr = fopen(LOAD_FILE_NAME, "w");
+    if (file_ptr == NULL) {
+        cerr << "Error: opening a file" << endl;
+        return;
+    }
+    for (auto it = load_list.begin(); it != load_list.end(); ++it) {
+        load_stat* load = *it;
+        if (load->count == 0 || load->repeated_stride == 0) {
+            continue;
+        }
+        if ((double)load->l1_misses / load->count < DELINQUENT_MISS_RATIO) {
+            continue;
+        }
+        if ((double)load->stride_repeats / load->count < STABLE_STRIDE_RATIO) {
+            continue;
+        }
+        INT64 stride = (INT64)load->repeated_stride;
+        fprintf(file_ptr, "%s,%lu,%lu,%lu,%lu,%ld,%ld\n",
+            load->stat->rtn_name.c_str(),
+            load->ins_addr - load->stat->rtn_addr,
+            load->count,
+            load->l1_misses,
+            load->llc_misses,
+            stride,
+            stride * (INT64)prefetch_distance(load));
+    }
+    fclose(file_ptr);
+}
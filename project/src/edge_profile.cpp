@@ -0,0 +1,221 @@
+#include "pin.H"
+#include "prof_rtn_stat.h"
+#include "profile.h"
+#include <cstdio>
+#include <iostream>
+#include <set>
+#include <stdlib.h>
+#include <unordered_map>
+#include <vector>
+
+using std::cerr;
+using std::endl;
+using std::set;
+using std::unordered_map;
+using std::vector;
+
+KNOB<BOOL> prof_edges_knob(KNOB_MODE_WRITEONCE, "pintool", "prof_edges", "0", "count every basic block and CFG edge of the main executable routines and save them to the file profile_edges.csv");
+
+static vector<rtn_cfg*> cfg_list;
+
+// Counts executions of a basic block
+VOID PIN_FAST_ANALYSIS_CALL block_entry_count(UINT64* counter)
+{
+    (*counter)++;
+}
+
+// Counts traversals of a conditional branch edge
+VOID PIN_FAST_ANALYSIS_CALL edge_count(UINT64* counter)
+{
+    (*counter)++;
+}
+
+// Instructions that end a basic block, calls return to the next instruction so they do not
+static bool ends_block(INS ins)
+{
+    return (INS_IsControlFlow(ins) && !INS_IsCall(ins));
+}
+
+static VOID add_cfg_edge(rtn_cfg* cfg, UINT32 src, UINT32 dst, cfg_edge_kind kind, bool derived)
+{
+    UINT32 edge_id = cfg->edges.size();
+    cfg->edges.push_back(cfg_edge(src, dst, kind, derived));
+    cfg->blocks[src].succs.push_back(edge_id);
+    cfg->blocks[dst].preds.push_back(edge_id);
+}
+
+rtn_cfg* build_rtn_cfg(RTN rtn, rtn_stat* stat)
+{
+    ADDRINT start_addr = RTN_Address(rtn);
+    ADDRINT end_addr = start_addr + RTN_Size(rtn);
+    set<ADDRINT> leaders;
+    bool prev_ends_block = true;
+
+    // Find the leaders: the entry, targets of direct branches inside the routine and whatever follows a block end
+    for (INS ins = RTN_InsHead(rtn); INS_Valid(ins); ins = INS_Next(ins)) {
+        if (prev_ends_block) {
+            leaders.insert(INS_Address(ins));
+        }
+        prev_ends_block = ends_block(ins);
+        if (INS_IsDirectBranch(ins)) {
+            ADDRINT target_addr = INS_DirectControlFlowTargetAddress(ins);
+            if (start_addr <= target_addr && target_addr < end_addr) {
+                leaders.insert(target_addr);
+            }
+        }
+    }
+
+    rtn_cfg* cfg = new rtn_cfg(stat);
+    unordered_map<ADDRINT, UINT32> block_ids;
+    for (INS ins = RTN_InsHead(rtn); INS_Valid(ins); ins = INS_Next(ins)) {
+        ADDRINT ins_addr = INS_Address(ins);
+        if (leaders.count(ins_addr)) {
+            block_ids[ins_addr] = cfg->blocks.size();
+            cfg->blocks.push_back(cfg_block(ins_addr));
+        }
+        cfg->blocks.back().tail_addr = ins_addr;
+        cfg->blocks.back().ins_num++;
+    }
+
+    // Connect every block tail to its successors, jumps out of the routine, returns and indirect jumps have none
+    UINT32 block_id = 0;
+    for (INS ins = RTN_InsHead(rtn); INS_Valid(ins); ins = INS_Next(ins)) {
+        ADDRINT ins_addr = INS_Address(ins);
+        auto start_it = block_ids.find(ins_addr);
+        if (start_it != block_ids.end()) {
+            block_id = start_it->second;
+        }
+        if (ins_addr != cfg->blocks[block_id].tail_addr) {
+            continue;
+        }
+        auto next_it = block_ids.find(ins_addr + INS_Size(ins));
+        if (INS_Category(ins) == XED_CATEGORY_COND_BR) {
+            auto target_it = block_ids.find(INS_DirectControlFlowTargetAddress(ins));
+            if (target_it != block_ids.end()) {
+                add_cfg_edge(cfg, block_id, target_it->second, EDGE_TAKEN, false);
+            }
+            if (next_it != block_ids.end()) {
+                add_cfg_edge(cfg, block_id, next_it->second, EDGE_FALLTHROUGH, false);
+            }
+        } else if (INS_IsDirectBranch(ins)) {
+            auto target_it = block_ids.find(INS_DirectControlFlowTargetAddress(ins));
+            if (target_it != block_ids.end()) {
+                add_cfg_edge(cfg, block_id, target_it->second, EDGE_JUMP, true);
+            }
+        } else if (!ends_block(ins) && next_it != block_ids.end()) {
+            add_cfg_edge(cfg, block_id, next_it->second, EDGE_FALLTHROUGH, true);
+        }
+    }
+
+    cfg->block_counts = (UINT64*)calloc(cfg->blocks.size(), sizeof(UINT64));
+    cfg->edge_counts = (UINT64*)calloc(cfg->edges.size() + 1, sizeof(UINT64));
+    if (cfg->block_counts == nullptr || cfg->edge_counts == nullptr) {
+        cerr << "Error: allocating the CFG counters of " << stat->rtn_name << endl;
+        free(cfg->block_counts);
+        free(cfg->edge_counts);
+        delete cfg;
+        return nullptr;
+    }
+    cfg_list.push_back(cfg);
+    return cfg;
+}
+
+INT32 find_cfg_block(rtn_cfg* cfg, ADDRINT addr)
+{
+    // blocks are sorted by address
+    UINT32 low = 0, high = cfg->blocks.size();
+    while (low < high) {
+        UINT32 mid = (low + high) / 2;
+        if (cfg->blocks[mid].start_addr < addr) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low < cfg->blocks.size() && cfg->blocks[low].start_addr == addr) {
+        return low;
+    }
+    return -1;
+}
+
+// Counts every block at its leader and both edges of every conditional branch,
+// the other edges are the only successor of their block and are derived from the block counts
+VOID instrument_rtn_edges(RTN rtn, rtn_cfg* cfg)
+{
+    UINT32 block_id = 0;
+    for (INS ins = RTN_InsHead(rtn); INS_Valid(ins); ins = INS_Next(ins)) {
+        INT32 start_id = find_cfg_block(cfg, INS_Address(ins));
+        if (start_id >= 0) {
+            block_id = start_id;
+            insert_collector_counter(ins, IPOINT_BEFORE, (AFUNPTR)block_entry_count, &(cfg->block_counts[block_id]));
+        }
+        cfg_block& block = cfg->blocks[block_id];
+        if (INS_Address(ins) != block.tail_addr) {
+            continue;
+        }
+        for (auto it = block.succs.begin(); it != block.succs.end(); ++it) {
+            cfg_edge& edge = cfg->edges[*it];
+            if (edge.kind == EDGE_TAKEN && INS_IsValidForIpointTakenBranch(ins)) {
+                insert_collector_counter(ins, IPOINT_TAKEN_BRANCH, (AFUNPTR)edge_count, &(cfg->edge_counts[*it]));
+            }
+            if (edge.kind == EDGE_FALLTHROUGH && !edge.derived && INS_IsValidForIpointAfter(ins)) {
+                insert_collector_counter(ins, IPOINT_AFTER, (AFUNPTR)edge_count, &(cfg->edge_counts[*it]));
+            }
+        }
+    }
+}
+
+VOID fill_derived_edge_counts(rtn_cfg* cfg)
+{
+    for (UINT32 edge_id = 0; edge_id < cfg->edges.size(); edge_id++) {
+        if (cfg->edges[edge_id].derived) {
+            cfg->edge_counts[edge_id] = cfg->block_counts[cfg->edges[edge_id].src];
+        }
+    }
+}
+
+static const char* edge_kind_name(cfg_edge_kind kind)
+{
+    switch (kind) {
+    case EDGE_TAKEN:
+        return "T";
+    case EDGE_JUMP:
+        return "J";
+    default:
+        return "F";
+    }
+}
+
+// Each routine gets its block rows followed by its edge rows, offsets are from the start of the routine:
+// routine name,block,block id,start offset,tail offset,count
+// routine name,edge,source block id,destination block id,kind (T taken, F fallthrough, J jump),count
+VOID write_edge_profile()
+{
+    FILE* file_ptr = fopen(EDGE_FILE_NAME, "w");
+    if (file_ptr == NULL) {
+        cerr << "Error: opening a file" << endl;
+        return;
+    }
+    for (auto it = cfg_list.begin(); it != cfg_list.end(); ++it) {
+        rtn_cfg* cfg = *it;
+        ADDRINT rtn_addr = cfg->stat->rtn_addr;
+        fill_derived_edge_counts(cfg);
+        for (UINT32 block_id = 0; block_id < cfg->blocks.size(); block_id++) {
+            fprintf(file_ptr, "%s,block,%u,%lu,%lu,%lu\n",
+                cfg->stat->rtn_name.c_str(),
+                block_id,
+                cfg->blocks[block_id].start_addr - rtn_addr,
+                cfg->blocks[block_id].tail_addr - rtn_addr,
+                cfg->block_counts[block_id]);
+        }
+        for (UINT32 edge_id = 0; edge_id < cfg->edges.size(); edge_id++) {
+            fprintf(file_ptr, "%s,edge,%u,%u,%s,%lu\n",
+                cfg->stat->rtn_name.c_str(),
+                cfg->edges[edge_id].src,
+                cfg->edges[edge_id].dst,
+                edge_kind_name(cfg->edges[edge_id].kind),
+                cfg->edge_counts[edge_id]);
+        }
+    }
+    fclose(file_ptr);
+}
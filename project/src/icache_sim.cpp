@@ -0,0 +1,149 @@
+#include "pin.H"
+#include "prof_rtn_stat.h"
+#include "profile.h"
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdlib.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using std::cerr;
+using std::endl;
+using std::string;
+using std::unordered_map;
+using std::vector;
+
+KNOB<BOOL> prof_icache_knob(KNOB_MODE_WRITEONCE, "pintool", "prof_icache", "0", "simulate the instruction cache and the iTLB on the original layout and on the TC layout of tc_layout.csv and save the misses to the file profile_icache.csv");
+KNOB<UINT32> prof_icache_size_knob(KNOB_MODE_WRITEONCE, "pintool", "prof_icache_size", "32768", "simulated instruction cache size in bytes");
+KNOB<UINT32> prof_icache_assoc_knob(KNOB_MODE_WRITEONCE, "pintool", "prof_icache_assoc", "8", "simulated instruction cache associativity");
+KNOB<UINT32> prof_icache_line_knob(KNOB_MODE_WRITEONCE, "pintool", "prof_icache_line", "64", "simulated instruction cache line size in bytes");
+KNOB<UINT32> prof_itlb_entries_knob(KNOB_MODE_WRITEONCE, "pintool", "prof_itlb_entries", "64", "simulated iTLB entries");
+KNOB<UINT32> prof_itlb_assoc_knob(KNOB_MODE_WRITEONCE, "pintool", "prof_itlb_assoc", "4", "simulated iTLB associativity");
+KNOB<UINT32> prof_page_size_knob(KNOB_MODE_WRITEONCE, "pintool", "prof_page_size", "4096", "simulated page size in bytes");
+
+// The instruction cache and the iTLB seen by one code layout
+struct sim_layout {
+    string name;
+    sim_cache icache;
+    sim_cache itlb;
+
+    sim_layout(string name)
+        : name(name)
+        , icache(prof_icache_size_knob.Value(), prof_icache_assoc_knob.Value(), prof_icache_line_knob.Value())
+        , itlb(prof_itlb_entries_knob.Value() * prof_page_size_knob.Value(), prof_itlb_assoc_knob.Value(), prof_page_size_knob.Value())
+    {
+    }
+};
+
+// The cache lines and the pages a basic block is fetched from, in both layouts
+struct bbl_fetch {
+    vector<ADDRINT> orig_lines;
+    vector<ADDRINT> orig_pages;
+    vector<ADDRINT> tc_lines;
+    vector<ADDRINT> tc_pages;
+};
+
+static sim_layout* orig_layout;
+static sim_layout* tc_layout;
+static unordered_map<ADDRINT, ADDRINT> tc_offset_map; // image offset of an original instruction -> its TC offset
+
+VOID fetch_bbl(bbl_fetch* fetch)
+{
+    for (auto it = fetch->orig_lines.begin(); it != fetch->orig_lines.end(); ++it) {
+        orig_layout->icache.access(*it);
+    }
+    for (auto it = fetch->orig_pages.begin(); it != fetch->orig_pages.end(); ++it) {
+        orig_layout->itlb.access(*it);
+    }
+    if (tc_layout == nullptr) {
+        return;
+    }
+    for (auto it = fetch->tc_lines.begin(); it != fetch->tc_lines.end(); ++it) {
+        tc_layout->icache.access(*it);
+    }
+    for (auto it = fetch->tc_pages.begin(); it != fetch->tc_pages.end(); ++it) {
+        tc_layout->itlb.access(*it);
+    }
+}
+
+// Adds the units (lines or pages) that [addr, addr + size) spans, skipping a repeat of the last one
+static VOID add_fetch_units(vector<ADDRINT>& units, ADDRINT addr, UINT32 size, ADDRINT unit_size)
+{
+    for (ADDRINT unit = addr & ~(unit_size - 1); unit < addr + size; unit += unit_size) {
+        if (units.empty() || units.back() != unit) {
+            units.push_back(unit);
+        }
+    }
+}
+
+VOID init_icache_sim()
+{
+    orig_layout = new sim_layout("original");
+    tc_layout = nullptr;
+    std::ifstream layout_file(LAYOUT_FILE_NAME);
+    if (!layout_file.is_open()) {
+        cerr << LAYOUT_FILE_NAME << " not found, only the original layout is simulated (run -opt -dump_layout to create it)" << endl;
+        return;
+    }
+    string line, field;
+    while (getline(layout_file, line)) {
+        std::stringstream s_stream(line);
+        getline(s_stream, field, ',');
+        ADDRINT orig_offset = std::stoull(field, nullptr, 16);
+        getline(s_stream, field, ',');
+        ADDRINT new_offset = std::stoull(field, nullptr, 16);
+        // An inlined routine has a copy in every caller, the fetches go to the first one
+        tc_offset_map.insert({ orig_offset, new_offset });
+    }
+    tc_layout = new sim_layout("tc");
+}
+
+// Every basic block of the run is simulated, the code that was not translated has the same address in both layouts.
+// The layout file holds offsets, they are rebased on the main executable of this run and the TC is placed on
+// the first page after it
+VOID instrument_trace_icache(TRACE trace)
+{
+    ADDRINT line_size = prof_icache_line_knob.Value();
+    ADDRINT page_size = prof_page_size_knob.Value();
+    ADDRINT tc_base = (main_image_high() + page_size) & ~(page_size - 1);
+    for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl)) {
+        bbl_fetch* fetch = new bbl_fetch();
+        add_fetch_units(fetch->orig_lines, BBL_Address(bbl), BBL_Size(bbl), line_size);
+        add_fetch_units(fetch->orig_pages, BBL_Address(bbl), BBL_Size(bbl), page_size);
+        for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins)) {
+            ADDRINT addr = INS_Address(ins);
+            if (addr >= main_image_base() && addr <= main_image_high()) {
+                auto it = tc_offset_map.find(addr - main_image_base());
+                if (it != tc_offset_map.end()) {
+                    addr = tc_base + it->second;
+                }
+            }
+            add_fetch_units(fetch->tc_lines, addr, INS_Size(ins), line_size);
+            add_fetch_units(fetch->tc_pages, addr, INS_Size(ins), page_size);
+        }
+        BBL_InsertCall(bbl, IPOINT_BEFORE, (AFUNPTR)fetch_bbl, IARG_PTR, fetch, IARG_END);
+    }
+}
+
+// One row per layout: layout,icache accesses,icache misses,itlb accesses,itlb misses
+VOID write_icache_profile()
+{
+    FILE* file_ptr = fopen(ICACHE_FILE_NAME, "w");
+    if (file_ptr == NULL) {
+        cerr << "Error: opening a file" << endl;
+        return;
+    }
+    sim_layout* layouts[] = { orig_layout, tc_layout };
+    for (sim_layout* layout : layouts) {
+        if (layout == nullptr) {
+            continue;
+        }
+        fprintf(file_ptr, "%s,%lu,%lu,%lu,%lu\n", layout->name.c_str(),
+            layout->icache.accesses, layout->icache.misses,
+            layout->itlb.accesses, layout->itlb.misses);
+    }
+    fclose(file_ptr);
+}
@@ -0,0 +1,132 @@
+#include "pin.H"
+#include "prof_rtn_stat.h"
+#include "profile.h"
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <stdlib.h>
+#include <unordered_map>
+#include <vector>
+
+using std::cerr;
+using std::endl;
+using std::pair;
+using std::string;
+using std::unordered_map;
+using std::vector;
+
+KNOB<BOOL> prof_indirect_knob(KNOB_MODE_WRITEONCE, "pintool", "prof_indirect", "0", "profile the targets of the indirect calls and jumps of the main executable and save them to the file profile_indirect.csv");
+KNOB<UINT32> prof_indirect_slots_knob(KNOB_MODE_WRITEONCE, "pintool", "prof_indirect_slots", "4", "number of targets kept for each indirect call or jump site");
+
+// Bounded target table of an indirect call or jump site. When the table is full a new target replaces
+// the least counted one and inherits its count (space saving), so the heavy targets always stay in the table.
+// The threads of the application update the table under its lock
+struct indirect_site {
+    rtn_stat* stat;
+    ADDRINT site_addr;
+    bool is_call;
+    UINT64 total; // how many times the site was executed
+    UINT32 used; // used slots
+    ADDRINT* targets;
+    UINT64* counts;
+    PIN_LOCK lock;
+
+    indirect_site(rtn_stat* stat, ADDRINT site_addr, bool is_call, UINT32 slots)
+        : stat(stat)
+        , site_addr(site_addr)
+        , is_call(is_call)
+        , total(0)
+        , used(0)
+        , targets(new ADDRINT[slots])
+        , counts(new UINT64[slots])
+    {
+        PIN_InitLock(&lock);
+    }
+};
+
+static unordered_map<ADDRINT, indirect_site*> indirect_site_map; // site address -> its target table
+static vector<indirect_site*> indirect_site_list;
+
+VOID indirect_target_count(indirect_site* site, ADDRINT target_addr, THREADID tid)
+{
+    PIN_GetLock(&site->lock, tid + 1);
+    site->total++;
+    UINT32 min_slot = 0;
+    for (UINT32 slot = 0; slot < site->used; slot++) {
+        if (site->targets[slot] == target_addr) {
+            site->counts[slot]++;
+            PIN_ReleaseLock(&site->lock);
+            return;
+        }
+        if (site->counts[slot] < site->counts[min_slot]) {
+            min_slot = slot;
+        }
+    }
+    if (site->used < prof_indirect_slots_knob.Value()) {
+        site->targets[site->used] = target_addr;
+        site->counts[site->used] = 1;
+        site->used++;
+    } else {
+        site->targets[min_slot] = target_addr;
+        site->counts[min_slot]++;
+    }
+    PIN_ReleaseLock(&site->lock);
+}
+
+VOID instrument_indirect_site(INS ins, rtn_stat* stat)
+{
+    ADDRINT site_addr = INS_Address(ins);
+    indirect_site* site;
+    auto it = indirect_site_map.find(site_addr);
+    if (it != indirect_site_map.end()) {
+        site = it->second;
+    } else {
+        site = new indirect_site(stat, site_addr, INS_IsCall(ins), prof_indirect_slots_knob.Value());
+        indirect_site_map[site_addr] = site;
+        indirect_site_list.push_back(site);
+    }
+    ins_insert_fn insert_call = insert_collector_gate(ins, IPOINT_BEFORE);
+    insert_call(ins, IPOINT_BEFORE, (AFUNPTR)indirect_target_count, IARG_PTR, site, IARG_BRANCH_TARGET_ADDR, IARG_THREAD_ID, IARG_END);
+}
+
+// One row per target of every site, the targets of a site are sorted by count:
+// routine name,site offset,call or jump,site count,target rank,target offset,target image,target routine name,target count.
+// A target in the main executable is an offset from its low address tagged with its build-id, so -opt can rebase it
+// on a PIE loaded at another address; a target in another image keeps its address and the OTHER_IMAGE tag
+VOID write_indirect_profile()
+{
+    FILE* file_ptr = fopen(INDIRECT_FILE_NAME, "w");
+    if (file_ptr == NULL) {
+        cerr << "Error: opening a file" << endl;
+        return;
+    }
+    for (auto it = indirect_site_list.begin(); it != indirect_site_list.end(); ++it) {
+        indirect_site* site = *it;
+        vector<pair<UINT64, ADDRINT>> targets; // count, target address
+        for (UINT32 slot = 0; slot < site->used; slot++) {
+            targets.push_back({ site->counts[slot], site->targets[slot] });
+        }
+        std::sort(targets.begin(), targets.end(),
+            [](const pair<UINT64, ADDRINT>& a, const pair<UINT64, ADDRINT>& b) { return a.first > b.first; });
+        for (size_t rank = 0; rank < targets.size(); rank++) {
+            ADDRINT target_addr = targets[rank].second;
+            string target_name = RTN_FindNameByAddress(target_addr);
+            string target_image = OTHER_IMAGE;
+            if (target_addr >= main_image_base() && target_addr <= main_image_high()) {
+                target_addr -= main_image_base();
+                target_image = main_image_build_id().empty() ? NO_BUILD_ID : main_image_build_id();
+            }
+            fprintf(file_ptr, "%s,%lu,%s,%lu,%zu,0x%lx,%s,%s,%lu\n",
+                site->stat->rtn_name.c_str(),
+                site->site_addr - site->stat->rtn_addr,
+                site->is_call ? "call" : "jump",
+                site->total,
+                rank,
+                target_addr,
+                target_image.c_str(),
+                target_name.c_str(),
+                targets[rank].first);
+        }
+    }
+    fclose(file_ptr);
+}
@@ -0,0 +1,156 @@
+#include "pin.H"
+#include "prof_rtn_stat.h"
+#include "profile.h"
+#include <cstdio>
+#include <iostream>
+#include <stdlib.h>
+#include <unordered_map>
+#include <vector>
+
+using std::cerr;
+using std::endl;
+using std::unordered_map;
+using std::vector;
+
+KNOB<BOOL> prof_loops_knob(KNOB_MODE_WRITEONCE, "pintool", "prof_loops", "0", "profile the loops of the main executable routines and save their trip count histograms to the file profile_loops.csv");
+
+// A loop found by its back edges, every direct jump to an address at or above the routine start and
+// not above the jump itself closes a loop at that address
+struct loop_stat {
+    rtn_stat* stat;
+    ADDRINT header_addr;
+    ADDRINT latch_addr; // the back edge with the highest address
+    UINT64 from_back_edge; // set by a taken back edge and cleared by the header
+    UINT64 trip_count; // iterations of the current invocation
+    UINT64 invocations;
+    UINT64 iterations;
+    UINT64 trip_hist[LOOP_HIST_BUCKETS]; // bucket b counts the invocations of 2^b to 2^(b+1)-1 iterations
+
+    loop_stat(rtn_stat* stat, ADDRINT header_addr, ADDRINT latch_addr)
+        : stat(stat)
+        , header_addr(header_addr)
+        , latch_addr(latch_addr)
+        , from_back_edge(0)
+        , trip_count(0)
+        , invocations(0)
+        , iterations(0)
+        , trip_hist()
+    {
+    }
+};
+
+static unordered_map<ADDRINT, loop_stat*> loop_header_map; // header address -> loop
+static unordered_map<ADDRINT, loop_stat*> loop_latch_map; // back edge address -> loop
+static vector<loop_stat*> loop_list;
+
+VOID PIN_FAST_ANALYSIS_CALL loop_back_edge(loop_stat* loop)
+{
+    loop->from_back_edge = 1;
+}
+
+// Counts an iteration when the header is reached by a back edge, and returns whether a new invocation starts
+ADDRINT PIN_FAST_ANALYSIS_CALL loop_header_is_entry(loop_stat* loop)
+{
+    UINT64 back = loop->from_back_edge;
+    loop->trip_count += back;
+    loop->from_back_edge = 0;
+    return !back;
+}
+
+static VOID record_trip_count(loop_stat* loop)
+{
+    UINT64 trip_count = loop->trip_count;
+    if (trip_count == 0) {
+        return;
+    }
+    UINT32 bucket = 63 - __builtin_clzll(trip_count);
+    if (bucket >= LOOP_HIST_BUCKETS) {
+        bucket = LOOP_HIST_BUCKETS - 1;
+    }
+    loop->trip_hist[bucket]++;
+    loop->invocations++;
+    loop->iterations += trip_count;
+}
+
+// Closes the previous invocation of the loop and starts a new one
+VOID PIN_FAST_ANALYSIS_CALL loop_entry(loop_stat* loop)
+{
+    record_trip_count(loop);
+    loop->trip_count = 1;
+}
+
+static bool is_back_edge(INS ins, rtn_stat* stat)
+{
+    if (!INS_IsDirectControlFlow(ins) || INS_IsCall(ins)) {
+        return false;
+    }
+    ADDRINT target_addr = INS_DirectControlFlowTargetAddress(ins);
+    return target_addr >= stat->rtn_addr && target_addr <= INS_Address(ins);
+}
+
+VOID find_rtn_loops(RTN rtn, rtn_stat* stat)
+{
+    for (INS ins = RTN_InsHead(rtn); INS_Valid(ins); ins = INS_Next(ins)) {
+        if (!is_back_edge(ins, stat)) {
+            continue;
+        }
+        ADDRINT header_addr = INS_DirectControlFlowTargetAddress(ins);
+        loop_stat* loop;
+        auto it = loop_header_map.find(header_addr);
+        if (it != loop_header_map.end()) {
+            loop = it->second;
+            loop->latch_addr = INS_Address(ins);
+        } else {
+            loop = new loop_stat(stat, header_addr, INS_Address(ins));
+            loop_header_map[header_addr] = loop;
+            loop_list.push_back(loop);
+        }
+        loop_latch_map[INS_Address(ins)] = loop;
+    }
+}
+
+// The loop collectors keep state across instructions, so they are neither sampled nor per thread
+VOID instrument_loop_ins(INS ins)
+{
+    auto header_it = loop_header_map.find(INS_Address(ins));
+    if (header_it != loop_header_map.end()) {
+        INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR)loop_header_is_entry, IARG_FAST_ANALYSIS_CALL, IARG_PTR, header_it->second, IARG_END);
+        INS_InsertThenCall(ins, IPOINT_BEFORE, (AFUNPTR)loop_entry, IARG_FAST_ANALYSIS_CALL, IARG_PTR, header_it->second, IARG_END);
+    }
+    auto latch_it = loop_latch_map.find(INS_Address(ins));
+    if (latch_it != loop_latch_map.end()) {
+        IPOINT ipoint = INS_Category(ins) == XED_CATEGORY_COND_BR ? IPOINT_TAKEN_BRANCH : IPOINT_BEFORE;
+        INS_InsertCall(ins, ipoint, (AFUNPTR)loop_back_edge, IARG_FAST_ANALYSIS_CALL, IARG_PTR, latch_it->second, IARG_END);
+    }
+}
+
+// One row per loop that ran:
+// routine name,header offset,latch offset,invocations,iterations,trip count histogram separated by spaces
+VOID write_loop_profile()
+{
+    FILE* file_ptr = fopen(LOOP_FILE_NAME, "w");
+    if (file_ptr == NULL) {
+        cerr << "Error: opening a file" << endl;
+        return;
+    }
+    for (auto it = loop_list.begin(); it != loop_list.end(); ++it) {
+        loop_stat* loop = *it;
+        // Close the invocation that was running when the program ended
+        record_trip_count(loop);
+        loop->trip_count = 0;
+        if (loop->invocations == 0) {
+            continue;
+        }
+        fprintf(file_ptr, "%s,%lu,%lu,%lu,%lu,",
+            loop->stat->rtn_name.c_str(),
+            loop->header_addr - loop->stat->rtn_addr,
+            loop->latch_addr - loop->stat->rtn_addr,
+            loop->invocations,
+            loop->iterations);
+        for (UINT32 bucket = 0; bucket < LOOP_HIST_BUCKETS; bucket++) {
+            fprintf(file_ptr, (bucket == 0) ? "%lu" : " %lu", loop->trip_hist[bucket]);
+        }
+        fprintf(file_ptr, "\n");
+    }
+    fclose(file_ptr);
+}
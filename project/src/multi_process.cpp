@@ -0,0 +1,186 @@
+#include "pin.H"
+#include "prof_rtn_stat.h"
+#include "profile.h"
+#include "profile_merge.h"
+#include <dirent.h>
+#include <errno.h>
+#include <iostream>
+#include <limits.h>
+#include <map>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::map;
+using std::string;
+using std::vector;
+
+#define SESSION_DIR_FORMAT "prof_session.%d"
+#define PROCESS_PROFILE_FORMAT "%s/%s.%d.%u.bin" // session directory, build-id, pid, exec sequence
+
+extern KNOB<BOOL> prof_csv_knob;
+extern KNOB<BOOL> prof_per_thread_knob;
+
+KNOB<BOOL> prof_follow_knob(KNOB_MODE_WRITEONCE, "pintool", "prof_follow", "0", "profile forked children and, with pin's -follow_execv, exec'ed children too; every process writes its own profile and the launched process merges them by executable when it exits");
+KNOB<string> prof_session_knob(KNOB_MODE_WRITEONCE, "pintool", "prof_session", "", "session directory of a -prof_follow process tree, passed by the launched process to its children");
+
+static string session_dir; // absolute, the children may change their working directory
+static bool session_root = false; // the process pin was launched on, it merges the profiles at exit
+static string process_profile; // profile file of this process, picked on the first write
+static vector<const char*> child_pin_argv; // pin command line of the exec'ed images
+
+// The build-id tags the file so the profiles can be grouped by executable
+const char* process_profile_name()
+{
+    if (!process_profile.empty()) {
+        return process_profile.c_str();
+    }
+    string build_id = main_image_build_id().empty() ? NO_BUILD_ID : main_image_build_id();
+    char file_name[PATH_MAX];
+    // A process that execs the same executable again keeps its pid
+    for (UINT32 seq = 0;; seq++) {
+        snprintf(file_name, sizeof(file_name), PROCESS_PROFILE_FORMAT, session_dir.c_str(), build_id.c_str(), (INT32)PIN_GetPid(), seq);
+        if (access(file_name, F_OK) != 0) {
+            break;
+        }
+    }
+    process_profile = file_name;
+    return process_profile.c_str();
+}
+
+static bool write_process_profile()
+{
+    if (prof_per_thread_knob) {
+        merge_thread_slabs();
+    }
+    return write_profile(process_profile_name(), false);
+}
+
+// The child starts an empty profile of its own, the counts up to the fork belong to the parent
+static VOID fork_child(THREADID tid, const CONTEXT* ctxt, VOID* v)
+{
+    if (session_root) {
+        session_root = false;
+        child_pin_argv.push_back("-prof_session");
+        child_pin_argv.push_back(strdup(session_dir.c_str()));
+    }
+    process_profile.clear();
+    reset_profile_counters();
+    stop_snapshots_after_fork();
+    stop_telemetry_after_fork();
+    stop_window_after_fork();
+}
+
+// The profile of the old executable is written before exec replaces it, its fini never runs.
+// The new image keeps the pid and so the session: if the launched process execs, the new image finds its
+// session directory already there and becomes the root that merges the profiles
+static BOOL follow_child(CHILD_PROCESS child, VOID* v)
+{
+    write_process_profile();
+    CHILD_PROCESS_SetPinCommandLine(child, (INT)child_pin_argv.size(), child_pin_argv.data());
+    return TRUE;
+}
+
+bool init_follow(int argc, char* argv[])
+{
+    if (!prof_follow_knob) {
+        return true;
+    }
+    if (prof_csv_knob) {
+        cerr << "Error: -prof_follow writes profile.bin files, it cannot be used with -prof_csv" << endl;
+        return false;
+    }
+    // Their csv files are keyed by routine name, the processes of the tree would overwrite each other's
+    if (prof_paths_knob || prof_indirect_knob || prof_loops_knob || prof_cct_knob || prof_icache_knob || prof_dcache_knob) {
+        cerr << "Error: -prof_paths, -prof_indirect, -prof_loops, -prof_cct, -prof_icache and -prof_dcache "
+             << "write csv files, they cannot be used with -prof_follow" << endl;
+        return false;
+    }
+    session_dir = prof_session_knob.Value();
+    if (session_dir.empty()) {
+        char cwd[PATH_MAX];
+        char dir_name[64];
+        if (getcwd(cwd, sizeof(cwd)) == nullptr) {
+            cerr << "Error: cannot get the working directory" << endl;
+            return false;
+        }
+        snprintf(dir_name, sizeof(dir_name), SESSION_DIR_FORMAT, (INT32)PIN_GetPid());
+        session_dir = string(cwd) + "/" + dir_name;
+        if (mkdir(session_dir.c_str(), 0755) != 0 && errno != EEXIST) {
+            cerr << "Error: cannot create " << session_dir << endl;
+            return false;
+        }
+        session_root = true;
+    }
+    // An exec'ed image gets the pin command line of this process without the application part, forked
+    // children add -prof_session to it. Pin keeps the application environment away from the tool, so the
+    // session directory goes on the command line
+    for (int i = 0; i < argc && strcmp(argv[i], "--") != 0; i++) {
+        child_pin_argv.push_back(argv[i]);
+    }
+    PIN_AddForkFunction(FPOINT_AFTER_IN_CHILD, fork_child, 0);
+    PIN_AddFollowChildProcessFunction(follow_child, 0);
+    return true;
+}
+
+// Merges the profiles of the process tree by executable: the executable pin was launched on gets profile.bin,
+// every other one profile.<build-id>.bin, which -opt picks up for a child with that build-id
+VOID merge_process_profiles()
+{
+    if (!session_root) {
+        return;
+    }
+    map<string, vector<string>> files_by_build_id;
+    DIR* dir = opendir(session_dir.c_str());
+    if (dir == nullptr) {
+        cerr << "Error: cannot open " << session_dir << endl;
+        return;
+    }
+    for (struct dirent* entry = readdir(dir); entry != nullptr; entry = readdir(dir)) {
+        string name = entry->d_name;
+        if (name.size() > 4 && name.compare(name.size() - 4, 4, ".bin") == 0) {
+            files_by_build_id[name.substr(0, name.find('.'))].push_back(session_dir + "/" + name);
+        }
+    }
+    closedir(dir);
+
+    for (auto it = files_by_build_id.begin(); it != files_by_build_id.end(); ++it) {
+        // Executables without a build-id cannot be told apart
+        if (it->first == NO_BUILD_ID) {
+            cerr << "Warning: " << it->second.size() << " profiles of executables without a build-id are left in "
+                 << session_dir << endl;
+            continue;
+        }
+        merged_profile merged;
+        uint64_t image_base = 0;
+        for (const string& file_name : it->second) {
+            size_t file_size;
+            const char* base = map_profile_bin(file_name.c_str(), &file_size);
+            if (base == nullptr) {
+                continue;
+            }
+            image_base = ((const profile_bin_header*)base)->image_base;
+            merge_profile_bin(merged, base, 1.0, file_name.c_str());
+            munmap((void*)base, file_size);
+        }
+        char out_name[PATH_MAX];
+        if (it->first == main_image_build_id()) {
+            snprintf(out_name, sizeof(out_name), "%s", PROFILE_BIN_FILE_NAME);
+        } else {
+            snprintf(out_name, sizeof(out_name), PROFILE_BIN_IMAGE_FILE_FORMAT, it->first.c_str());
+        }
+        if (!write_merged(merged, it->first, image_base, out_name)) {
+            cerr << "Error: writing " << out_name << endl;
+            continue;
+        }
+        cout << "merged " << it->second.size() << " process profiles of build-id " << it->first << " into " << out_name << endl;
+    }
+    // Without a build-id the launched executable still gets its profile.bin
+    if (main_image_build_id().empty()) {
+        write_profile(PROFILE_BIN_FILE_NAME, false);
+    }
+}
@@ -12,6 +12,9 @@ using std::hex;
 extern KNOB<BOOL> KnobVerbose;
 extern KNOB<BOOL> KnobDumpTranslatedCode;
 extern KNOB<BOOL> KnobDoNotCommitTranslatedCode;
+
+KNOB<UINT32> KnobPromoteRatio(KNOB_MODE_WRITEONCE, "pintool",
+    "promote_ratio", "90", "Percent of an indirect call site executions its hottest target needs for the call to be promoted");
 extern xed_state_t dstate;
 
 const static unsigned int max_inst_len = XED_MAX_INSTRUCTION_BYTES;
@@ -26,6 +29,7 @@ typedef struct {
 
 extern translated_rtn_t* translated_rtn;
 extern int translated_rtn_num;
+extern char* tc;
 
 int add_new_instr_entry(xed_decoded_inst_t* xedd, ADDRINT pc, unsigned int size);
 
@@ -243,6 +247,167 @@ void create_uncond_jump(ADDRINT jmp_addr, ADDRINT target_addr)
     }
 }
 
+// Encodes the instruction and adds it to the instr map as if it was at pc in the original code
+int add_encoded_instr_entry(xed_encoder_instruction_t* enc_instr, ADDRINT pc)
+{
+    UINT8 enc_buf[max_inst_len];
+    unsigned int new_size;
+    xed_encoder_request_t enc_req;
+
+    xed_encoder_request_zero_set_mode(&enc_req, &dstate);
+
+    xed_bool_t convert_ok = xed_convert_to_encoder_request(&enc_req, enc_instr);
+    if (!convert_ok) {
+        cerr << "conversion to encode request failed" << endl;
+        return -1;
+    }
+
+    xed_error_enum_t xed_error = xed_encode(&enc_req, enc_buf, max_inst_len, &new_size);
+    if (xed_error != XED_ERROR_NONE) {
+        cerr << "ENCODE ERROR: " << xed_error_enum_t2str(xed_error) << endl;
+        return -1;
+    }
+
+    xed_decoded_inst_t xedd;
+
+    xed_decoded_inst_zero_set_mode(&xedd, &dstate);
+    xed_error = xed_decode(&xedd, enc_buf, new_size);
+    if (xed_error != XED_ERROR_NONE) {
+        cerr << "ERROR: xed decode failed for instr at: "
+             << "0x" << hex << pc << endl;
+        return -1;
+    }
+
+    return add_new_instr_entry(&xedd, pc, new_size);
+}
+
+// Adds a direct jump, conditional jump or call at pc whose original target is target_addr,
+// so the chaining later links it to the translated target
+int add_direct_branch_entry(xed_iclass_enum_t iclass, ADDRINT pc, ADDRINT target_addr)
+{
+    xed_encoder_instruction_t enc_instr;
+    // rel32 jmp and call are 5 bytes long and rel32 jcc is 6 bytes long
+    unsigned int size = (iclass == XED_ICLASS_JMP || iclass == XED_ICLASS_CALL_NEAR) ? 5 : 6;
+    int disp = (int)(target_addr - pc) - size;
+
+    xed_inst1(&enc_instr, dstate, iclass, 64, xed_relbr(disp, 32));
+    return add_encoded_instr_entry(&enc_instr, pc);
+}
+
+// Returns the dominant profiled target of the indirect call at the routine offset, or 0 if there is none
+// or it cannot be promoted
+ADDRINT get_promoted_target(prof_rtn_stat* prof_stat, UINT32 site_offset)
+{
+    for (auto it = prof_stat->indirect_targets.begin(); it != prof_stat->indirect_targets.end(); ++it) {
+        if (it->site_offset != site_offset || !it->is_call) {
+            continue;
+        }
+        // The hottest target of a site comes first
+        if (it->count * 100 < it->site_count * KnobPromoteRatio.Value()) {
+            return 0;
+        }
+        const char* reason = nullptr;
+        if (it->target_addr == 0) {
+            reason = "the target is not in this build of the main executable";
+        } else if (it->target_addr != (ADDRINT)(INT64)(INT32)it->target_addr) {
+            // The target is compared as a sign extended 32 bit immediate
+            reason = "the target does not fit a 32 bit immediate";
+        } else if ((INT64)(it->target_addr - (ADDRINT)tc) != (INT64)(INT32)(it->target_addr - (ADDRINT)tc)) {
+            // and called with a 32 bit displacement from the TC
+            reason = "the target is out of rel32 reach of the TC";
+        }
+        if (reason != nullptr) {
+            cerr << "Warning: indirect call at " << prof_stat->rtn_name << "+0x" << hex << site_offset << dec
+                 << " to " << it->target_name << " is not promoted, " << reason << endl;
+            return 0;
+        }
+        return it->target_addr;
+    }
+    return 0;
+}
+
+// Promotes a hot indirect call into a guarded direct call:
+//    cmp  <call operand>, target
+//    jnz  miss
+//    call target      ; chained into the translated target when it has a translation
+//    jmp  next
+// miss:
+//    call <call operand>
+// The miss call gets the original address + 1 so the jnz is chained to it and not to the cmp
+bool promote_indirect_call(INS ins, xed_decoded_inst_t* xedd, ADDRINT target_addr)
+{
+    ADDRINT ins_addr = INS_Address(ins);
+    xed_encoder_operand_t call_operand;
+
+    if (xed_decoded_inst_number_of_memory_operands(xedd) > 0) {
+        xed_reg_enum_t base_reg = xed_decoded_inst_get_base_reg(xedd, 0);
+        xed_reg_enum_t seg_reg = xed_decoded_inst_get_seg_reg(xedd, 0);
+        // rip relative operands are fixed by their original size and fs/gs are thread pointers
+        if (base_reg == XED_REG_RIP || seg_reg == XED_REG_FS || seg_reg == XED_REG_GS) {
+            return false;
+        }
+        xed_enc_displacement_t disp = xed_disp(xed_decoded_inst_get_memory_displacement(xedd, 0),
+            xed_decoded_inst_get_memory_displacement_width(xedd, 0) * 8);
+        call_operand = xed_mem_bisd(base_reg, xed_decoded_inst_get_index_reg(xedd, 0),
+            xed_decoded_inst_get_scale(xedd, 0), disp, 64);
+    } else {
+        call_operand = xed_reg(xed_decoded_inst_get_reg(xedd, XED_OPERAND_REG0));
+    }
+
+    xed_encoder_instruction_t enc_instr;
+    xed_inst2(&enc_instr, dstate, XED_ICLASS_CMP, 64, call_operand, xed_simm0((INT32)target_addr, 32));
+    if (add_encoded_instr_entry(&enc_instr, ins_addr) < 0
+        || add_direct_branch_entry(XED_ICLASS_JNZ, ins_addr, ins_addr + 1) < 0
+        || add_direct_branch_entry(XED_ICLASS_CALL_NEAR, ins_addr, target_addr) < 0
+        || add_direct_branch_entry(XED_ICLASS_JMP, ins_addr, ins_addr + INS_Size(ins)) < 0
+        || add_new_instr_entry(xedd, ins_addr + 1, INS_Size(ins)) < 0) {
+        cerr << "ERROR: failed during instructon translation." << endl;
+        translated_rtn[translated_rtn_num].instr_map_entry = -1;
+    }
+    if (KnobVerbose) {
+        cerr << "promoted indirect call at 0x" << hex << ins_addr << " to 0x" << target_addr << endl;
+    }
+    return true;
+}
+
+// Returns the prefetch distance of the delinquent load at the routine offset, or 0 if it is not one
+INT64 get_prefetch_distance(prof_rtn_stat* prof_stat, UINT32 load_offset)
+{
+    for (auto it = prof_stat->loads.begin(); it != prof_stat->loads.end(); ++it) {
+        if (it->offset == load_offset) {
+            return it->prefetch_distance;
+        }
+    }
+    return 0;
+}
+
+// Adds a prefetcht0 of the load's memory operand moved distance bytes ahead, before the load itself.
+// The prefetch takes the load's original address, so the branches to the load are chained to the prefetch
+void add_prefetch(INS ins, xed_decoded_inst_t* xedd, INT64 distance)
+{
+    if (xed_decoded_inst_number_of_memory_operands(xedd) == 0) {
+        return;
+    }
+    xed_reg_enum_t base_reg = xed_decoded_inst_get_base_reg(xedd, 0);
+    xed_reg_enum_t seg_reg = xed_decoded_inst_get_seg_reg(xedd, 0);
+    // rip relative operands are fixed by their original size and fs/gs are thread pointers
+    if (base_reg == XED_REG_RIP || seg_reg == XED_REG_FS || seg_reg == XED_REG_GS) {
+        return;
+    }
+    INT64 disp = xed_decoded_inst_get_memory_displacement(xedd, 0) + distance;
+    if (disp != (INT64)(INT32)disp) {
+        return;
+    }
+    xed_encoder_instruction_t enc_instr;
+    xed_inst1(&enc_instr, dstate, XED_ICLASS_PREFETCHT0, 0,
+        xed_mem_bisd(base_reg, xed_decoded_inst_get_index_reg(xedd, 0), xed_decoded_inst_get_scale(xedd, 0),
+            xed_disp(disp, 32), 8));
+    if (add_encoded_instr_entry(&enc_instr, INS_Address(ins)) < 0) {
+        cerr << "ERROR: failed during instructon translation." << endl;
+        translated_rtn[translated_rtn_num].instr_map_entry = -1;
+    }
+}
+
 void copy_not_taken_block(INS not_taken_ins, prof_rtn_stat* prof_stat, ADDRINT taken_addr, UINT32 inline_offset)
 {
     ADDRINT not_taken_addr = INS_Address(not_taken_ins);
@@ -264,8 +429,8 @@ void copy_not_taken_block(INS not_taken_ins, prof_rtn_stat* prof_stat, ADDRINT t
         }
 
         if ((UINT32)(ins_addr - not_taken_addr) == inline_offset) {
-            prof_rtn_stat* prof_callee_stat = rtn_map[prof_stat->inline_callee_name];
             RTN callee_rtn = RTN_FindByAddress(INS_DirectControlFlowTargetAddress(ins));
+            prof_rtn_stat* prof_callee_stat = find_prof_stat(callee_rtn);
             copy_inlined_routine(callee_rtn, prof_callee_stat);
         } else {
             // Add instr into instr map:
@@ -288,6 +453,8 @@ void optimize_translated_routine(RTN rtn, prof_rtn_stat* prof_stat)
     int rc;
     INS not_taken_ins;
     ADDRINT taken_addr = 0, not_taken_addr = 0;
+    ADDRINT promoted_target;
+    INT64 prefetch_distance;
 
     // Open the RTN.
     RTN_Open(rtn);
@@ -337,14 +504,23 @@ void optimize_translated_routine(RTN rtn, prof_rtn_stat* prof_stat)
 
         // Start Copying the inline callee
         else if ((prof_stat->opt_mode & OPT_INLINE) && (UINT32)(ins_addr - rtn_addr) == inline_offset) {
-            prof_rtn_stat* prof_callee_stat = rtn_map[prof_stat->inline_callee_name];
             RTN callee_rtn = RTN_FindByAddress(INS_DirectControlFlowTargetAddress(ins));
+            prof_rtn_stat* prof_callee_stat = find_prof_stat(callee_rtn);
             RTN_Close(rtn);
             copy_inlined_routine(callee_rtn, prof_callee_stat);
             RTN_Open(rtn);
         }
+        // Guard the hot indirect call with its dominant target
+        else if ((prof_stat->opt_mode & OPT_PROMOTE) && INS_IsIndirectControlFlow(ins) && INS_IsCall(ins)
+            && (promoted_target = get_promoted_target(prof_stat, (UINT32)(ins_addr - rtn_addr))) != 0
+            && promote_indirect_call(ins, &xedd, promoted_target)) {
+            verbose_inst(ins);
+        }
         // just copy it as usual
         else {
+            if ((prof_stat->opt_mode & OPT_PREFETCH) && (prefetch_distance = get_prefetch_distance(prof_stat, (UINT32)(ins_addr - rtn_addr))) != 0) {
+                add_prefetch(ins, &xedd, prefetch_distance);
+            }
             // Add instr into instr map:
             rc = add_new_instr_entry(&xedd, INS_Address(ins), INS_Size(ins));
             if (rc < 0) {
@@ -0,0 +1,425 @@
+#include "pin.H"
+#include "prof_rtn_stat.h"
+#include "profile.h"
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <stdlib.h>
+#include <unordered_map>
+#include <vector>
+
+using std::cerr;
+using std::endl;
+using std::pair;
+using std::unordered_map;
+using std::vector;
+
+#define PATH_ARRAY_LIMIT (1 << 12) // routines with more paths count them in a hash map
+#define PATH_LIMIT (0xffffffffULL) // routines with more paths are not profiled
+
+KNOB<BOOL> prof_paths_knob(KNOB_MODE_WRITEONCE, "pintool", "prof_paths", "0", "Ball-Larus acyclic path profiling of the main executable routines, the hot paths are saved to the file profile_paths.csv");
+extern KNOB<BOOL> prof_per_thread_knob;
+
+KNOB<UINT32> prof_paths_top_knob(KNOB_MODE_WRITEONCE, "pintool", "prof_paths_top", "5", "number of hot paths saved for each routine");
+
+// Edge of the acyclic graph the paths are numbered on, node blocks.size() is the virtual exit
+struct dag_edge {
+    UINT32 dst;
+    UINT64 val; // added to the path register when the edge is taken
+    INT32 cfg_edge_id; // the CFG edge it stands for, -1 for the exit edges and the dummy edges
+    bool dummy; // entry -> loop header edge that stands for a path starting after a back edge
+
+    dag_edge(UINT32 dst, INT32 cfg_edge_id, bool dummy)
+        : dst(dst)
+        , val(0)
+        , cfg_edge_id(cfg_edge_id)
+        , dummy(dummy)
+    {
+    }
+};
+
+struct rtn_path_stat {
+    rtn_cfg* cfg;
+    UINT64 num_paths;
+    vector<vector<dag_edge>> dag; // out edges per node, used to regenerate a path from its number
+    UINT64* counts; // flat path counters when there are few paths
+    bool counts_in_slabs; // the flat counters have slab slots from first_slot on, only with -prof_per_thread
+    UINT32 first_slot;
+    unordered_map<UINT64, UINT64> sparse_counts; // path counters when there are many paths
+    PIN_LOCK sparse_lock;
+
+    rtn_path_stat(rtn_cfg* cfg)
+        : cfg(cfg)
+        , num_paths(0)
+        , dag()
+        , counts(nullptr)
+        , counts_in_slabs(false)
+        , first_slot(0)
+        , sparse_counts()
+    {
+        PIN_InitLock(&sparse_lock);
+    }
+};
+
+static REG path_reg; // tool register holding the path sum of the current routine
+static vector<rtn_path_stat*> path_stat_list;
+static unordered_map<rtn_cfg*, rtn_path_stat*> path_stat_map; // nullptr for the routines left out of the profile
+
+/* ===================================================================== */
+/* Analysis routines                                                     */
+/* ===================================================================== */
+
+// The flat counters are counted like the other collectors, in the thread's slab or in the shared array
+static VOID record_path(rtn_path_stat* path_stat, thread_state* state, UINT64 path)
+{
+    if (path_stat->counts_in_slabs) {
+        state->slab[path_stat->first_slot + path]++;
+        return;
+    }
+    if (path_stat->counts != nullptr) {
+        path_stat->counts[path]++;
+        return;
+    }
+    PIN_GetLock(&path_stat->sparse_lock, 1);
+    path_stat->sparse_counts[path]++;
+    PIN_ReleaseLock(&path_stat->sparse_lock);
+}
+
+// Routine entry: saves the caller's path register and starts a new path
+VOID PIN_FAST_ANALYSIS_CALL path_enter(thread_state* state, ADDRINT* path_sum)
+{
+    state->path_stack.push_back(*path_sum);
+    *path_sum = 0;
+}
+
+// The single register increment on an edge
+VOID PIN_FAST_ANALYSIS_CALL path_edge(ADDRINT* path_sum, UINT32 val)
+{
+    *path_sum += val;
+}
+
+// Back edge: the path ends at the source block and the next one starts at the loop header
+VOID PIN_FAST_ANALYSIS_CALL path_back_edge(rtn_path_stat* path_stat, thread_state* state, ADDRINT* path_sum,
+    UINT32 exit_val, UINT32 restart_val)
+{
+    record_path(path_stat, state, *path_sum + exit_val);
+    *path_sum = restart_val;
+}
+
+// Routine exit: the path ends and the caller's path register comes back
+VOID PIN_FAST_ANALYSIS_CALL path_exit(rtn_path_stat* path_stat, thread_state* state, ADDRINT* path_sum, UINT32 exit_val)
+{
+    record_path(path_stat, state, *path_sum + exit_val);
+    if (state->path_stack.empty()) {
+        *path_sum = 0;
+        return;
+    }
+    *path_sum = state->path_stack.back();
+    state->path_stack.pop_back();
+}
+
+/* ===================================================================== */
+/* Instrumentation                                                       */
+/* ===================================================================== */
+
+// Finds the back edges with a depth first search from the entry block
+static vector<bool> find_back_edges(rtn_cfg* cfg, vector<bool>* reachable)
+{
+    vector<bool> back_edges(cfg->edges.size(), false);
+    vector<UINT8> color(cfg->blocks.size(), 0); // 0 unvisited, 1 on the stack, 2 done
+    vector<pair<UINT32, UINT32>> stack; // block id, next successor index
+
+    stack.push_back({ 0, 0 });
+    color[0] = 1;
+    while (!stack.empty()) {
+        UINT32 block_id = stack.back().first;
+        UINT32 succ_index = stack.back().second;
+        if (succ_index == cfg->blocks[block_id].succs.size()) {
+            color[block_id] = 2;
+            stack.pop_back();
+            continue;
+        }
+        stack.back().second++;
+        UINT32 edge_id = cfg->blocks[block_id].succs[succ_index];
+        UINT32 dst = cfg->edges[edge_id].dst;
+        if (color[dst] == 1) {
+            back_edges[edge_id] = true;
+        } else if (color[dst] == 0) {
+            color[dst] = 1;
+            stack.push_back({ dst, 0 });
+        }
+    }
+    for (UINT32 block_id = 0; block_id < cfg->blocks.size(); block_id++) {
+        (*reachable)[block_id] = (color[block_id] != 0);
+    }
+    return back_edges;
+}
+
+// Numbers the paths of the acyclic graph: nodes are visited in reverse topological order and every out edge
+// gets the number of paths through the out edges before it, so each entry to exit path sums to a unique number
+static bool number_paths(rtn_path_stat* path_stat)
+{
+    UINT32 exit_node = path_stat->cfg->blocks.size();
+    vector<UINT64> num_paths(exit_node + 1, 0);
+    vector<UINT8> visited(exit_node + 1, 0);
+    vector<pair<UINT32, UINT32>> stack;
+
+    num_paths[exit_node] = 1;
+    visited[exit_node] = 1;
+    stack.push_back({ 0, 0 });
+    visited[0] = 1;
+    while (!stack.empty()) {
+        UINT32 node = stack.back().first;
+        vector<dag_edge>& out_edges = path_stat->dag[node];
+        if (stack.back().second < out_edges.size()) {
+            UINT32 dst = out_edges[stack.back().second++].dst;
+            if (!visited[dst]) {
+                visited[dst] = 1;
+                stack.push_back({ dst, 0 });
+            }
+            continue;
+        }
+        // post order: all of the successors are numbered
+        for (auto it = out_edges.begin(); it != out_edges.end(); ++it) {
+            it->val = num_paths[node];
+            num_paths[node] += num_paths[it->dst];
+            if (num_paths[node] > PATH_LIMIT) {
+                return false;
+            }
+        }
+        stack.pop_back();
+    }
+    path_stat->num_paths = num_paths[0];
+    return true;
+}
+
+// The out edge of node that goes to dst and stands for the CFG edge cfg_edge_id
+static dag_edge* find_dag_edge(rtn_path_stat* path_stat, UINT32 node, UINT32 dst, INT32 cfg_edge_id, bool dummy)
+{
+    vector<dag_edge>& out_edges = path_stat->dag[node];
+    for (auto it = out_edges.begin(); it != out_edges.end(); ++it) {
+        if (it->dst == dst && it->cfg_edge_id == cfg_edge_id && it->dummy == dummy) {
+            return &(*it);
+        }
+    }
+    return nullptr;
+}
+
+static IPOINT edge_ipoint(cfg_edge& edge)
+{
+    if (edge.derived) {
+        return IPOINT_BEFORE;
+    }
+    return (edge.kind == EDGE_TAKEN) ? IPOINT_TAKEN_BRANCH : IPOINT_AFTER;
+}
+
+// Numbers the paths of a routine, returns nullptr if it has too many
+static rtn_path_stat* build_path_stat(rtn_cfg* cfg, const vector<bool>& exits, const vector<bool>& reachable,
+    const vector<bool>& back_edges)
+{
+    UINT32 exit_node = cfg->blocks.size();
+    rtn_path_stat* path_stat = new rtn_path_stat(cfg);
+
+    // The acyclic graph: back edges u->v turn into the dummy edges entry->v and u->exit
+    path_stat->dag.resize(exit_node + 1);
+    vector<bool> exit_edge(cfg->blocks.size(), false);
+    for (UINT32 edge_id = 0; edge_id < cfg->edges.size(); edge_id++) {
+        cfg_edge& edge = cfg->edges[edge_id];
+        if (!reachable[edge.src]) {
+            continue;
+        }
+        if (back_edges[edge_id]) {
+            exit_edge[edge.src] = true;
+            if (find_dag_edge(path_stat, 0, edge.dst, -1, true) == nullptr) {
+                path_stat->dag[0].push_back(dag_edge(edge.dst, -1, true));
+            }
+        } else {
+            path_stat->dag[edge.src].push_back(dag_edge(edge.dst, edge_id, false));
+        }
+    }
+    for (UINT32 id = 0; id < cfg->blocks.size(); id++) {
+        if (reachable[id] && (exits[id] || exit_edge[id])) {
+            path_stat->dag[id].push_back(dag_edge(exit_node, -1, false));
+        }
+    }
+    if (!number_paths(path_stat)) {
+        cerr << "Warning: too many paths in " << cfg->stat->rtn_name << ", it is left out of the path profile" << endl;
+        delete path_stat;
+        return nullptr;
+    }
+    if (path_stat->num_paths <= PATH_ARRAY_LIMIT) {
+        path_stat->counts = (UINT64*)calloc(path_stat->num_paths, sizeof(UINT64));
+        path_stat->counts_in_slabs = prof_per_thread_knob && path_stat->counts != nullptr
+            && get_counter_slot_range(path_stat->counts, path_stat->num_paths, &path_stat->first_slot);
+    }
+    path_stat_list.push_back(path_stat);
+    return path_stat;
+}
+
+// Pin instruments a routine again when its code is regenerated (tiered profiling), the numbering and the
+// counters of the first time are kept
+VOID instrument_rtn_paths(RTN rtn, rtn_cfg* cfg)
+{
+    UINT32 exit_node = cfg->blocks.size();
+
+    // A loop back to the entry block cannot be told apart from a new call,
+    // and jump tables are not in the CFG, such routines are left out
+    if (!cfg->blocks[0].preds.empty()) {
+        return;
+    }
+    for (INS ins = RTN_InsHead(rtn); INS_Valid(ins); ins = INS_Next(ins)) {
+        if (INS_IsIndirectControlFlow(ins) && !INS_IsCall(ins) && !INS_IsRet(ins)) {
+            return;
+        }
+    }
+
+    // Blocks that leave the routine: returns and direct branches to targets outside the routine
+    vector<bool> exits(cfg->blocks.size(), false);
+    UINT32 block_id = 0;
+    for (INS ins = RTN_InsHead(rtn); INS_Valid(ins); ins = INS_Next(ins)) {
+        INT32 start_id = find_cfg_block(cfg, INS_Address(ins));
+        if (start_id >= 0) {
+            block_id = start_id;
+        }
+        if (INS_Address(ins) != cfg->blocks[block_id].tail_addr) {
+            continue;
+        }
+        if (INS_IsRet(ins) || (INS_IsDirectBranch(ins) && find_cfg_block(cfg, INS_DirectControlFlowTargetAddress(ins)) < 0)) {
+            exits[block_id] = true;
+        }
+    }
+
+    vector<bool> reachable(cfg->blocks.size(), false);
+    vector<bool> back_edges = find_back_edges(cfg, &reachable);
+    auto found = path_stat_map.find(cfg);
+    if (found == path_stat_map.end()) {
+        found = path_stat_map.insert({ cfg, build_path_stat(cfg, exits, reachable, back_edges) }).first;
+    }
+    rtn_path_stat* path_stat = found->second;
+    if (path_stat == nullptr) {
+        return;
+    }
+
+    block_id = 0;
+    for (INS ins = RTN_InsHead(rtn); INS_Valid(ins); ins = INS_Next(ins)) {
+        INT32 start_id = find_cfg_block(cfg, INS_Address(ins));
+        if (start_id >= 0) {
+            block_id = start_id;
+        }
+        if (ins == RTN_InsHead(rtn)) {
+            INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)path_enter, IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, thread_state_reg,
+                IARG_REG_REFERENCE, path_reg, IARG_END);
+        }
+        cfg_block& block = cfg->blocks[block_id];
+        if (INS_Address(ins) != block.tail_addr || !reachable[block_id]) {
+            continue;
+        }
+        dag_edge* exit_dag_edge = find_dag_edge(path_stat, block_id, exit_node, -1, false);
+        UINT32 exit_val = (exit_dag_edge != nullptr) ? exit_dag_edge->val : 0;
+        for (auto it = block.succs.begin(); it != block.succs.end(); ++it) {
+            cfg_edge& edge = cfg->edges[*it];
+            IPOINT ipoint = edge_ipoint(edge);
+            if (ipoint == IPOINT_AFTER && !INS_IsValidForIpointAfter(ins)) {
+                continue;
+            }
+            if (back_edges[*it]) {
+                UINT32 restart_val = find_dag_edge(path_stat, 0, edge.dst, -1, true)->val;
+                INS_InsertCall(ins, ipoint, (AFUNPTR)path_back_edge, IARG_FAST_ANALYSIS_CALL, IARG_PTR, path_stat,
+                    IARG_REG_VALUE, thread_state_reg, IARG_REG_REFERENCE, path_reg, IARG_UINT32, exit_val,
+                    IARG_UINT32, restart_val, IARG_END);
+                continue;
+            }
+            UINT32 val = find_dag_edge(path_stat, edge.src, edge.dst, *it, false)->val;
+            if (val != 0) {
+                INS_InsertCall(ins, ipoint, (AFUNPTR)path_edge, IARG_FAST_ANALYSIS_CALL,
+                    IARG_REG_REFERENCE, path_reg, IARG_UINT32, val, IARG_END);
+            }
+        }
+        if (exits[block_id]) {
+            // a conditional branch leaves the routine only when it is taken
+            IPOINT ipoint = (INS_Category(ins) == XED_CATEGORY_COND_BR) ? IPOINT_TAKEN_BRANCH : IPOINT_BEFORE;
+            INS_InsertCall(ins, ipoint, (AFUNPTR)path_exit, IARG_FAST_ANALYSIS_CALL, IARG_PTR, path_stat,
+                IARG_REG_VALUE, thread_state_reg, IARG_REG_REFERENCE, path_reg, IARG_UINT32, exit_val, IARG_END);
+        }
+    }
+}
+
+VOID init_path_profile()
+{
+    path_reg = PIN_ClaimToolRegister();
+    if (!REG_valid(path_reg)) {
+        cerr << "Error: cannot allocate a tool register for the path profiler" << endl;
+        PIN_ExitApplication(-1);
+    }
+}
+
+/* ===================================================================== */
+/* Output                                                                */
+/* ===================================================================== */
+
+// Walks the acyclic graph from the entry, taking at each node the out edge with the largest value
+// that still fits in what is left of the path number
+static vector<UINT32> regenerate_path(rtn_path_stat* path_stat, UINT64 path)
+{
+    UINT32 exit_node = path_stat->cfg->blocks.size();
+    vector<UINT32> blocks;
+    UINT32 node = 0;
+    while (node != exit_node) {
+        vector<dag_edge>& out_edges = path_stat->dag[node];
+        dag_edge* next = nullptr;
+        for (auto it = out_edges.begin(); it != out_edges.end(); ++it) {
+            if (it->val <= path && (next == nullptr || it->val >= next->val)) {
+                next = &(*it);
+            }
+        }
+        if (next == nullptr) {
+            break;
+        }
+        // a path that starts with a dummy edge starts at the loop header
+        if (!(node == 0 && next->dummy)) {
+            blocks.push_back(node);
+        }
+        path -= next->val;
+        node = next->dst;
+    }
+    return blocks;
+}
+
+// routine name,rank,path number,count,start offsets of the blocks on the path separated by spaces
+VOID write_path_profile()
+{
+    FILE* file_ptr = fopen(PATH_FILE_NAME, "w");
+    if (file_ptr == NULL) {
+        cerr << "Error: opening a file" << endl;
+        return;
+    }
+    for (auto it = path_stat_list.begin(); it != path_stat_list.end(); ++it) {
+        rtn_path_stat* path_stat = *it;
+        vector<pair<UINT64, UINT64>> hot_paths; // count, path number
+        if (path_stat->counts != nullptr) {
+            for (UINT64 path = 0; path < path_stat->num_paths; path++) {
+                if (path_stat->counts[path]) {
+                    hot_paths.push_back({ path_stat->counts[path], path });
+                }
+            }
+        } else {
+            for (auto path_it = path_stat->sparse_counts.begin(); path_it != path_stat->sparse_counts.end(); ++path_it) {
+                hot_paths.push_back({ path_it->second, path_it->first });
+            }
+        }
+        size_t top = std::min((size_t)prof_paths_top_knob.Value(), hot_paths.size());
+        std::partial_sort(hot_paths.begin(), hot_paths.begin() + top, hot_paths.end(),
+            [](const pair<UINT64, UINT64>& a, const pair<UINT64, UINT64>& b) { return a.first > b.first; });
+
+        rtn_stat* stat = path_stat->cfg->stat;
+        for (size_t rank = 0; rank < top; rank++) {
+            fprintf(file_ptr, "%s,%zu,%lu,%lu,", stat->rtn_name.c_str(), rank, hot_paths[rank].second, hot_paths[rank].first);
+            vector<UINT32> blocks = regenerate_path(path_stat, hot_paths[rank].second);
+            for (size_t i = 0; i < blocks.size(); i++) {
+                fprintf(file_ptr, (i == 0) ? "%lu" : " %lu", path_stat->cfg->blocks[blocks[i]].start_addr - stat->rtn_addr);
+            }
+            fprintf(file_ptr, "\n");
+        }
+    }
+    fclose(file_ptr);
+}
@@ -1,22 +1,128 @@
 #ifndef PROF_RTN_STAT
 #define PROF_RTN_STAT
 #include "pin.H"
+#include "profile_bin.h"
 #include <string>
+#include <vector>
 
 #define OUTPUT_FILE_NAME ("profile_stat.csv")
+#define PROFILE_BIN_FILE_NAME ("profile.bin")
+#define PROFILE_BIN_IMAGE_FILE_FORMAT "profile.%s.bin" // per build-id profile of a -prof_follow child executable
+#define EDGE_FILE_NAME ("profile_edges.csv")
+#define PATH_FILE_NAME ("profile_paths.csv")
+#define INDIRECT_FILE_NAME ("profile_indirect.csv")
+#define LOOP_FILE_NAME ("profile_loops.csv")
+#define CCT_FILE_NAME ("profile_cct.folded")
+#define CYCLES_FILE_NAME ("profile_cycles.csv")
+#define BRANCH_FILE_NAME ("profile_branches.csv")
+#define ICACHE_FILE_NAME ("profile_icache.csv")
+#define LOAD_FILE_NAME ("profile_loads.csv")
+#define LAYOUT_FILE_NAME ("tc_layout.csv") // written by -opt -dump_layout
 
-#define OPT_INLINE 0b01
-#define OPT_REORDER 0b10
-#define OPT_ALL (OPT_INLINE | OPT_REORDER)
+#define LOOP_HIST_BUCKETS 16 // log2 buckets of the loop trip counts
+#define NO_BUILD_ID "nobuildid" // stands for the build-id of an executable that has none
+#define OTHER_IMAGE "-" // image of an indirect target outside the main executable, its address is absolute
+
+// Block and edge frequencies from profile_edges.csv, offsets are from the start of the routine
+struct prof_block {
+    UINT32 start_offset;
+    UINT32 tail_offset;
+    UINT64 count;
+};
+
+struct prof_edge {
+    UINT32 src; // block index
+    UINT32 dst; // block index
+    char kind; // T taken, F fallthrough, J jump
+    UINT64 count;
+};
+
+// A conditional branch from profile_branches.csv with its simulated mispredictions
+struct prof_branch {
+    UINT32 offset;
+    UINT64 count;
+    UINT64 taken;
+    UINT64 mispredicts;
+};
+
+// A direct call site from profile.bin
+struct prof_call {
+    UINT32 offset;
+    ADDRINT callee_addr;
+    UINT64 count;
+};
+
+// A delinquent load with a stable stride from profile_loads.csv
+struct prof_load {
+    UINT32 offset;
+    UINT64 count;
+    UINT64 l1_misses;
+    UINT64 llc_misses;
+    INT64 stride;
+    INT64 prefetch_distance; // bytes ahead of the load address
+};
+
+// Opcode hash of a basic block, the fingerprint of a routine is the list of its block hashes in address order
+struct prof_block_hash {
+    UINT32 offset;
+    UINT32 size; // bytes
+    UINT32 hash;
+};
+
+// A hot acyclic path from profile_paths.csv
+struct prof_path {
+    UINT64 count;
+    std::vector<UINT32> block_offsets; // start offsets of the blocks on the path, in order
+};
+
+// A profiled target of an indirect call or jump site from profile_indirect.csv
+struct prof_indirect_target {
+    UINT32 site_offset;
+    bool is_call;
+    UINT64 site_count; // executions of the site
+    UINT64 target_offset; // from the low address of the main executable, or absolute for OTHER_IMAGE
+    std::string target_image; // build-id of the main executable the offset belongs to, or OTHER_IMAGE
+    ADDRINT target_addr; // rebased by -opt on the main executable, 0 if the target is not in it
+    std::string target_name;
+    UINT64 count;
+};
+
+// A loop from profile_loops.csv
+struct prof_loop {
+    UINT32 header_offset;
+    UINT32 latch_offset;
+    UINT64 invocations;
+    UINT64 iterations;
+    UINT64 trip_hist[LOOP_HIST_BUCKETS]; // bucket b counts the invocations of 2^b to 2^(b+1)-1 iterations
+};
 
 struct prof_rtn_stat {
     std::string rtn_name;
     ADDRINT rtn_addr;
+    ADDRINT image_offset; // from the low address of the main executable, only from profile.bin
     UINT64 heat;
+    UINT64 incl_cycles; // from profile_cycles.csv, 0 if the routine was not timed
+    UINT64 excl_cycles;
     UINT16 opt_mode;
     UINT32 rtn_branch_offset;
     UINT32 rtn_inline_offset;
     std::string inline_callee_name;
+    std::vector<prof_block> blocks; // indexed by block id
+    std::vector<prof_edge> edges;
+    std::vector<prof_path> hot_paths; // hottest first
+    std::vector<prof_indirect_target> indirect_targets; // grouped by site, hottest target first
+    std::vector<prof_loop> loops;
+    std::vector<prof_branch> branches;
+    std::vector<prof_call> calls; // only from profile.bin
+    std::vector<prof_load> loads;
+    std::vector<prof_block_hash> block_hashes; // fingerprint from profile.bin
+    UINT32 stale_confidence; // percentage of blocks matched to this build, only with -opt_stale
 };
 
+// Hex GNU build-id of an image, empty if it has no build-id note. Implemented in project.cpp
+std::string img_build_id(IMG img);
+
+// Block fingerprint of a routine, expects an open routine. Implemented in stale_match.cpp
+VOID rtn_fingerprint(RTN rtn, std::vector<prof_block_hash>& block_hashes);
+
 #endif
@@ -1,9 +1,11 @@
 #include "pin.H"
 #include "prof_rtn_stat.h"
+#include "profile.h"
 #include <algorithm>
 #include <cstdio>
 #include <iomanip>
 #include <iostream>
+#include <stdlib.h>
 #include <string.h>
 #include <unordered_map>
 #include <vector>
@@ -17,12 +19,25 @@ using std::string;
 using std::unordered_map;
 using std::vector;
 
-#define BRANCH_THRESHOLD 0.8
 #define GET_BRANCH_RATIO (X) (((double)(X).branch_taken)/((double)(X).branch_count)))
 
 #define RET_COUNT 1
 #define CALL_COUNT 4
 
+KNOB<BOOL> prof_per_thread_knob(KNOB_MODE_WRITEONCE, "pintool", "prof_per_thread", "0", "keep a private counter slab per thread and merge the slabs at exit (for multithreaded targets)");
+KNOB<UINT32> prof_slab_size_knob(KNOB_MODE_WRITEONCE, "pintool", "prof_slab_size", "1048576", "number of counters in each per-thread counter slab");
+KNOB<BOOL> prof_csv_knob(KNOB_MODE_WRITEONCE, "pintool", "prof_csv", "0", "write the routine statistics to profile_stat.csv instead of profile.bin");
+KNOB<UINT64> prof_sample_on_knob(KNOB_MODE_WRITEONCE, "pintool", "prof_sample_on", "0", "sampling: length in instructions of each burst that profiles branches and calls (0 = off)");
+KNOB<UINT64> prof_sample_off_knob(KNOB_MODE_WRITEONCE, "pintool", "prof_sample_off", "99000000", "sampling: number of instructions between two bursts");
+KNOB<BOOL> prof_roi_knob(KNOB_MODE_WRITEONCE, "pintool", "prof_roi", "0", "count only inside the regions the application marks with calls to the -prof_roi_begin and -prof_roi_end routines");
+KNOB<string> prof_roi_begin_knob(KNOB_MODE_WRITEONCE, "pintool", "prof_roi_begin", "dbt_roi_begin", "marker routine that opens a region of interest");
+KNOB<string> prof_roi_end_knob(KNOB_MODE_WRITEONCE, "pintool", "prof_roi_end", "dbt_roi_end", "marker routine that closes a region of interest");
+KNOB<UINT64> prof_skip_ins_knob(KNOB_MODE_WRITEONCE, "pintool", "prof_skip_ins", "0", "warm-up: do not count the first N main executable instructions");
+KNOB<UINT64> prof_window_ins_knob(KNOB_MODE_WRITEONCE, "pintool", "prof_window_ins", "0", "count only N main executable instructions after the warm-up, then stop profiling (0 = until exit)");
+KNOB<UINT32> prof_skip_secs_knob(KNOB_MODE_WRITEONCE, "pintool", "prof_skip_secs", "0", "warm-up: do not count the first N seconds");
+KNOB<UINT32> prof_window_secs_knob(KNOB_MODE_WRITEONCE, "pintool", "prof_window_secs", "0", "count only N seconds after the warm-up, then stop profiling (0 = until exit)");
+KNOB<UINT64> prof_tier_threshold_knob(KNOB_MODE_WRITEONCE, "pintool", "prof_tier_threshold", "0", "tiered profiling: count only routine entries until a routine is entered this many times, then profile its branches and calls (0 = off)");
+
 enum inline_valid {
     VALID, // Function valid for Inlining
     LAST_INS_NOT_RET, // Last instruction is not ret
@@ -34,84 +49,473 @@ enum inline_valid {
     MULTIPLE_CALLS // Multiple calls instruction
 };
 
-// Structure to find potential reordering candidates
-struct branch_stat {
-    ADDRINT branch_addr;
-    UINT64 branch_taken; // the number of times we took the jump
-    UINT64 branch_count; // how many times we got to that branch
+// Global variables
+static FILE* file_ptr;
+static unordered_map<ADDRINT, rtn_stat*> rtn_map;
+static unordered_map<ADDRINT, branch_stat*> branch_map; // branch instruction address -> its statistics
+static unordered_map<ADDRINT, call_stat*> call_map; // call instruction address -> its statistics
+// The routines are saved as offsets from the main executable's low address under its build-id
+static ADDRINT main_img_base = 0;
+static ADDRINT main_img_high = 0;
+static string main_img_build_id;
+// static vector<rtn_stat*> rtn_list;
+// static unordered_map<ADDRINT, unordered_map<ADDRINT, UINT64>> callSiteCounts;
 
-    branch_stat(ADDRINT branch_addr)
-        : branch_addr(branch_addr)
-        , branch_taken(0)
-        , branch_count(0)
-    {
-    }
+// Profiling gate: the gated collectors only count while no bit is set
+#define GATE_SAMPLE 0b1 // between two sampling bursts
+#define GATE_ROI 0b10 // outside the regions of interest
+#define GATE_WINDOW 0b100 // during the warm-up and after the profiling window
+static volatile UINT32 gate_closed = 0;
+// Profiling window, driven by a second instruction clock or by the window thread
+enum window_phase {
+    WINDOW_SKIP, // warm-up
+    WINDOW_ON,
+    WINDOW_DONE // the window is over, nothing is instrumented anymore
 };
+#define WINDOW_POLL_MS 100
+static volatile window_phase profile_window = WINDOW_ON;
+static volatile INT64 window_countdown = 0; // instructions left until the next window event
+static PIN_LOCK window_lock;
+static PIN_THREAD_UID window_thread_uid;
+static volatile bool window_thread_exit = false;
+static bool window_thread_running = false;
+// Regions of interest can nest, the gate opens at the outermost begin marker and closes at its end marker
+static PIN_LOCK roi_lock;
+static INT32 roi_depth = 0;
+static UINT32 roi_markers_found = 0;
+// Instruction clock of the main executable, it drives the sampling bursts
+static volatile INT64 clock_countdown = 0; // instructions left until the next clock event
 
-// Structure to find potential inline candidates
-struct call_stat {
-    ADDRINT callee_addr; // callee address
-    ADDRINT inst_call_addr; // instruction call address
-    UINT64 call_count; // how many times we got to the function
+// Per thread state of the profiling modules, kept in pin TLS and cached in a tool register
+static TLS_KEY thread_state_key = INVALID_TLS_KEY;
+REG thread_state_reg;
 
-    call_stat(ADDRINT callee_addr, ADDRINT inst_call_addr)
-        : callee_addr(callee_addr)
-        , inst_call_addr(inst_call_addr)
-        , call_count(0)
-    {
-    }
-};
+// Per thread counters: every shared counter gets a slot index, each thread counts into its own slab
+static REG slab_reg; // tool register that caches the current thread's slab pointer
+static PIN_LOCK slabs_lock;
+static vector<UINT64*> counter_slots; // slot index -> shared counter the slot is merged into
+static unordered_map<UINT64*, UINT32> counter_slot_map; // shared counter -> slot index
+static vector<UINT64*> thread_slabs; // slabs of all threads, including the ones that already exited
 
-// Structure to store statistics for a routine
-struct rtn_stat {
-    // string image_name;
-    // ADDRINT image_addr;
-    string rtn_name;
-    ADDRINT rtn_addr;
-    UINT64 rtn_count; // we will use this to figure out the percentage of calls the potential function
-    UINT64 ins_count; // used as a heat score for all of our routines
-    bool inline_valid;
-    vector<branch_stat*> branches; // vector to record branches behavior per routine
-    vector<call_stat*> rtn_calls; // map of call instruction metadata
-
-    rtn_stat(string rtn_name, ADDRINT rtn_addr)
-        : rtn_name(rtn_name)
-        , rtn_addr(rtn_addr)
-        , rtn_count(0)
-        , ins_count(0)
-        , inline_valid(true)
-        , branches()
-        , rtn_calls()
-    {
-    }
-};
+/* ===================================================================== */
+/* Analysis routines                                                     */
+/* ===================================================================== */
+// One specialized routine per instrumentation kind, all of them straight line code with no calls
+// and no data dependent branches so pin can inline them (run "make inline_report" to check)
 
-// Global variables
-static FILE* file_ptr;
-static unordered_map<ADDRINT, rtn_stat*> rtn_map;
-// static vector<rtn_stat*> rtn_list;
-// static unordered_map<ADDRINT, unordered_map<ADDRINT, UINT64>> callSiteCounts;
+// Counts routine executions
+VOID PIN_FAST_ANALYSIS_CALL rtn_entry_count(UINT64* counter)
+{
+    (*counter)++;
+}
 
-// Function to increment routine execution count
-VOID ins_count(UINT64* counter)
+// Counts the calls made from a direct call site
+VOID PIN_FAST_ANALYSIS_CALL call_site_count(UINT64* counter)
 {
     (*counter)++;
 }
 
-// Function to increment instruction count
-VOID bbl_count(UINT64* counter, UINT32 c)
+// Adds the instructions of an executed basic block to the routine heat
+VOID PIN_FAST_ANALYSIS_CALL bbl_ins_count(UINT64* counter, UINT32 c)
 {
     *counter += c;
 }
 
-VOID branch_taken_count(branch_stat* branch, BOOL taken)
+// Counts a conditional branch and its taken outcome without branching on it
+VOID PIN_FAST_ANALYSIS_CALL branch_outcome_count(branch_stat* branch, BOOL taken)
 {
-    if (taken) {
-        branch->branch_taken++;
-    }
+    branch->branch_taken += taken;
     branch->branch_count++;
 }
 
+// Advances the instruction clock and tells when the next clock event is due
+ADDRINT PIN_FAST_ANALYSIS_CALL clock_tick(UINT32 c)
+{
+    return ((clock_countdown -= c) <= 0);
+}
+
+// Lets the gated collectors run
+ADDRINT PIN_FAST_ANALYSIS_CALL gate_is_open()
+{
+    return (gate_closed == 0);
+}
+
+// Lets the routine and instruction counters run, they ignore the sampling bit
+ADDRINT PIN_FAST_ANALYSIS_CALL counter_gate_is_open()
+{
+    return ((gate_closed & ~GATE_SAMPLE) == 0);
+}
+
+// Clock event, toggles between a sampling burst and the quiet period after it.
+// The gate bits are set atomically since the region markers update the same word
+VOID clock_event()
+{
+    if (gate_closed & GATE_SAMPLE) {
+        __atomic_and_fetch(&gate_closed, ~GATE_SAMPLE, __ATOMIC_RELAXED);
+        clock_countdown = prof_sample_on_knob.Value();
+    } else {
+        __atomic_or_fetch(&gate_closed, GATE_SAMPLE, __ATOMIC_RELAXED);
+        clock_countdown = prof_sample_off_knob.Value();
+    }
+}
+
+// Advances the window clock and tells when the warm-up or the window ends
+ADDRINT PIN_FAST_ANALYSIS_CALL window_tick(UINT32 c)
+{
+    return ((window_countdown -= c) <= 0);
+}
+
+// Opens the gate after the warm-up and closes it for good at the end of the window
+VOID window_event()
+{
+    PIN_GetLock(&window_lock, 1);
+    // Another thread may have handled the event already
+    if (window_countdown > 0) {
+        PIN_ReleaseLock(&window_lock);
+        return;
+    }
+    if (profile_window == WINDOW_SKIP && prof_window_ins_knob) {
+        profile_window = WINDOW_ON;
+        __atomic_and_fetch(&gate_closed, ~GATE_WINDOW, __ATOMIC_RELAXED);
+        window_countdown = prof_window_ins_knob.Value();
+        PIN_ReleaseLock(&window_lock);
+        return;
+    }
+    if (profile_window == WINDOW_SKIP) {
+        // No window length, profile until exit
+        profile_window = WINDOW_ON;
+        __atomic_and_fetch(&gate_closed, ~GATE_WINDOW, __ATOMIC_RELAXED);
+    } else {
+        profile_window = WINDOW_DONE;
+        __atomic_or_fetch(&gate_closed, GATE_WINDOW, __ATOMIC_RELAXED);
+        // The code is regenerated without any instrumentation, see routine() and trace()
+        PIN_RemoveInstrumentation();
+    }
+    window_countdown = INT64_MAX;
+    PIN_ReleaseLock(&window_lock);
+}
+
+// Region of interest markers, called at the entry of the marker routines of the application
+VOID roi_begin()
+{
+    PIN_GetLock(&roi_lock, 1);
+    if (roi_depth++ == 0) {
+        __atomic_and_fetch(&gate_closed, ~GATE_ROI, __ATOMIC_RELAXED);
+    }
+    PIN_ReleaseLock(&roi_lock);
+}
+
+VOID roi_end()
+{
+    PIN_GetLock(&roi_lock, 1);
+    if (roi_depth > 0 && --roi_depth == 0) {
+        __atomic_or_fetch(&gate_closed, GATE_ROI, __ATOMIC_RELAXED);
+    }
+    PIN_ReleaseLock(&roi_lock);
+}
+
+// Tiered profiling: counts routine executions and tells when the routine became hot. The counter is shared and
+// atomic even with -prof_per_thread, so the threads that enter the routine add up to the threshold together
+ADDRINT PIN_FAST_ANALYSIS_CALL tier_entry_count(rtn_stat* stat, UINT64 threshold)
+{
+    return (__atomic_add_fetch(&stat->rtn_count, 1, __ATOMIC_RELAXED) >= threshold) & !stat->hot;
+}
+
+// Tiered profiling: drops the cheap code of a routine that became hot so its next traces are
+// regenerated by trace() with the branch and call collectors, the currently executing trace runs to its end.
+// The routine instrumentation goes too and Pin calls routine() again, which keeps the state it built the first time
+VOID promote_hot_rtn(rtn_stat* stat)
+{
+    // Other threads may still run the cold code, only the first one promotes
+    if (__atomic_exchange_n(&stat->hot, true, __ATOMIC_RELAXED)) {
+        return;
+    }
+    PIN_RemoveInstrumentationInRange(stat->rtn_addr, stat->rtn_addr + stat->rtn_size - 1);
+}
+
+// Per thread versions of the counting routines, the slab pointer comes from the tool register
+VOID PIN_FAST_ANALYSIS_CALL slab_counter_inc(UINT64* slab, UINT32 slot)
+{
+    slab[slot]++;
+}
+
+VOID PIN_FAST_ANALYSIS_CALL slab_counter_add(UINT64* slab, UINT32 slot, UINT32 c)
+{
+    slab[slot] += c;
+}
+
+VOID PIN_FAST_ANALYSIS_CALL slab_branch_outcome_count(UINT64* slab, UINT32 taken_slot, UINT32 count_slot, BOOL taken)
+{
+    slab[taken_slot] += taken;
+    slab[count_slot]++;
+}
+
+// Tells whether the slabs have no room for num_new more counters
+static bool slabs_full(size_t num_new)
+{
+    if (counter_slots.size() + num_new <= prof_slab_size_knob.Value()) {
+        return false;
+    }
+    static bool warned = false;
+    if (!warned) {
+        cerr << "Warning: counter slab is full, falling back to shared counters (raise -prof_slab_size)" << endl;
+        warned = true;
+    }
+    return true;
+}
+
+// Returns the slab slot of a shared counter, or false if the slabs are full
+bool get_counter_slot(UINT64* counter, UINT32* slot)
+{
+    auto it = counter_slot_map.find(counter);
+    if (it != counter_slot_map.end()) {
+        *slot = it->second;
+        return true;
+    }
+    if (slabs_full(1)) {
+        return false;
+    }
+    *slot = counter_slots.size();
+    counter_slots.push_back(counter);
+    counter_slot_map[counter] = *slot;
+    return true;
+}
+
+// Gives an array of counters indexed at run time num consecutive slots, returns false if they do not fit
+bool get_counter_slot_range(UINT64* counters, UINT32 num, UINT32* first_slot)
+{
+    if (slabs_full(num)) {
+        return false;
+    }
+    *first_slot = counter_slots.size();
+    for (UINT32 i = 0; i < num; i++) {
+        counter_slots.push_back(&counters[i]);
+        counter_slot_map[&counters[i]] = *first_slot + i;
+    }
+    return true;
+}
+
+// Both counters get a slot or neither does: merge_thread_slabs overwrites every counter that has a slot,
+// so a counter with a slot must never be counted in the shared memory
+bool get_counter_slots(UINT64* first, UINT64* second, UINT32* first_slot, UINT32* second_slot)
+{
+    if (slabs_full(!counter_slot_map.count(first) + !counter_slot_map.count(second))) {
+        return false;
+    }
+    return get_counter_slot(first, first_slot) && get_counter_slot(second, second_slot);
+}
+
+// The profiling modules that keep state per thread
+bool thread_state_needed()
+{
+    return prof_per_thread_knob || prof_paths_knob || prof_cct_knob || prof_time_knob;
+}
+
+VOID thread_start(THREADID tid, CONTEXT* ctxt, INT32 flags, VOID* v)
+{
+    UINT64* slab = nullptr;
+    if (prof_per_thread_knob) {
+        // calloc only reserves the memory, untouched slots will not take physical pages
+        slab = (UINT64*)calloc(prof_slab_size_knob.Value(), sizeof(UINT64));
+        if (slab == nullptr) {
+            cerr << "Error: allocating a counter slab for thread " << tid << endl;
+            PIN_ExitApplication(-1);
+        }
+        PIN_SetContextReg(ctxt, slab_reg, (ADDRINT)slab);
+
+        PIN_GetLock(&slabs_lock, tid + 1);
+        thread_slabs.push_back(slab);
+        PIN_ReleaseLock(&slabs_lock);
+    }
+    thread_state* state = new thread_state(slab);
+    if (prof_cct_knob) {
+        cct_thread_start(state, tid);
+    }
+    PIN_SetThreadData(thread_state_key, state, tid);
+    PIN_SetContextReg(ctxt, thread_state_reg, (ADDRINT)state);
+}
+
+VOID thread_fini(THREADID tid, const CONTEXT* ctxt, INT32 code, VOID* v)
+{
+    // The slab stays alive in thread_slabs until it is merged in fini
+    thread_state* state = (thread_state*)PIN_GetThreadData(thread_state_key, tid);
+    if (prof_time_knob && state != nullptr) {
+        time_thread_fini(state);
+    }
+    delete state;
+    PIN_SetThreadData(thread_state_key, nullptr, tid);
+}
+
+// Sums all of the thread slabs into the shared counters, safe to call more than once.
+// Only the counters that got a slot are assigned, and those are counted in the slabs alone
+VOID merge_thread_slabs()
+{
+    PIN_GetLock(&slabs_lock, 0);
+    for (size_t slot = 0; slot < counter_slots.size(); slot++) {
+        UINT64 sum = 0;
+        for (auto it = thread_slabs.begin(); it != thread_slabs.end(); ++it) {
+            sum += (*it)[slot];
+        }
+        *counter_slots[slot] = sum;
+    }
+    PIN_ReleaseLock(&slabs_lock);
+}
+
+// A forked child has a copy of the parent's counters, only the forking thread lives on in the child
+VOID reset_profile_counters()
+{
+    for (auto it = rtn_map.begin(); it != rtn_map.end(); ++it) {
+        rtn_stat* stat = it->second;
+        stat->rtn_count = 0;
+        stat->ins_count = 0;
+        stat->incl_cycles = 0;
+        stat->excl_cycles = 0;
+        stat->snapshot_ins_count = 0;
+        for (branch_stat* branch : stat->branches) {
+            branch->branch_taken = 0;
+            branch->branch_count = 0;
+            branch->mispredicts = 0;
+        }
+        for (call_stat* call : stat->rtn_calls) {
+            call->call_count = 0;
+        }
+        rtn_cfg* cfg = stat->cfg;
+        if (cfg != nullptr && cfg->block_counts != nullptr) {
+            memset(cfg->block_counts, 0, cfg->blocks.size() * sizeof(UINT64));
+            memset(cfg->edge_counts, 0, (cfg->edges.size() + 1) * sizeof(UINT64));
+        }
+    }
+    for (auto it = thread_slabs.begin(); it != thread_slabs.end(); ++it) {
+        memset(*it, 0, prof_slab_size_knob.Value() * sizeof(UINT64));
+    }
+}
+
+// Sampling bursts drive the GATE_SAMPLE bit from the instruction clock
+bool collectors_sampled()
+{
+    return prof_sample_on_knob != 0;
+}
+
+bool window_by_ins()
+{
+    return prof_skip_ins_knob || prof_window_ins_knob;
+}
+
+bool window_by_secs()
+{
+    return prof_skip_secs_knob || prof_window_secs_knob;
+}
+
+// The routine and instruction counters are gated only by the regions of interest and the profiling window
+bool counters_gated()
+{
+    return prof_roi_knob || window_by_ins() || window_by_secs();
+}
+
+typedef VOID (*bbl_insert_fn)(BBL, IPOINT, AFUNPTR, ...);
+
+// Counter insertion helpers, they pick the shared or the per thread flavor of the analysis routine
+VOID insert_rtn_counter(RTN rtn, UINT64* counter)
+{
+    UINT32 slot;
+    INS head = RTN_InsHead(rtn);
+    ins_insert_fn insert_call = INS_InsertCall;
+    if (counters_gated()) {
+        INS_InsertIfCall(head, IPOINT_BEFORE, (AFUNPTR)counter_gate_is_open, IARG_FAST_ANALYSIS_CALL, IARG_END);
+        insert_call = INS_InsertThenCall;
+    }
+    if (prof_per_thread_knob && get_counter_slot(counter, &slot)) {
+        insert_call(head, IPOINT_BEFORE, (AFUNPTR)slab_counter_inc, IARG_FAST_ANALYSIS_CALL,
+            IARG_REG_VALUE, slab_reg, IARG_UINT32, slot, IARG_END);
+    } else {
+        insert_call(head, IPOINT_BEFORE, (AFUNPTR)rtn_entry_count, IARG_FAST_ANALYSIS_CALL, IARG_PTR, counter, IARG_END);
+    }
+}
+
+// Counts routine entries and promotes the routine once it crosses the tier threshold.
+// A hot routine keeps this counter, so its entries stay in the one shared count
+VOID insert_tier_counter(RTN rtn, rtn_stat* stat)
+{
+    INS head = RTN_InsHead(rtn);
+    INS_InsertIfCall(head, IPOINT_BEFORE, (AFUNPTR)tier_entry_count, IARG_FAST_ANALYSIS_CALL,
+        IARG_PTR, stat, IARG_UINT64, prof_tier_threshold_knob.Value(), IARG_END);
+    INS_InsertThenCall(head, IPOINT_BEFORE, (AFUNPTR)promote_hot_rtn, IARG_PTR, stat, IARG_END);
+}
+
+// Branch and call collectors are sampled and follow the regions of interest, they only count while the gate is open
+bool collectors_gated()
+{
+    return collectors_sampled() || counters_gated();
+}
+
+// Starts the if/then pair of a gated collector and returns the function that inserts its counting call
+ins_insert_fn insert_collector_gate(INS ins, IPOINT ipoint)
+{
+    if (!collectors_gated()) {
+        return INS_InsertCall;
+    }
+    INS_InsertIfCall(ins, ipoint, (AFUNPTR)gate_is_open, IARG_FAST_ANALYSIS_CALL, IARG_END);
+    return INS_InsertThenCall;
+}
+
+VOID insert_collector_counter(INS ins, IPOINT ipoint, AFUNPTR count_fn, UINT64* counter)
+{
+    UINT32 slot;
+    bool per_thread = prof_per_thread_knob && get_counter_slot(counter, &slot);
+    ins_insert_fn insert_call = insert_collector_gate(ins, ipoint);
+    if (per_thread) {
+        insert_call(ins, ipoint, (AFUNPTR)slab_counter_inc, IARG_FAST_ANALYSIS_CALL,
+            IARG_REG_VALUE, slab_reg, IARG_UINT32, slot, IARG_END);
+    } else {
+        insert_call(ins, ipoint, count_fn, IARG_FAST_ANALYSIS_CALL, IARG_PTR, counter, IARG_END);
+    }
+}
+
+VOID insert_bbl_counter(BBL bbl, UINT64* counter, UINT32 c)
+{
+    UINT32 slot;
+    bbl_insert_fn insert_call = BBL_InsertCall;
+    if (counters_gated()) {
+        BBL_InsertIfCall(bbl, IPOINT_BEFORE, (AFUNPTR)counter_gate_is_open, IARG_FAST_ANALYSIS_CALL, IARG_END);
+        insert_call = BBL_InsertThenCall;
+    }
+    if (prof_per_thread_knob && get_counter_slot(counter, &slot)) {
+        insert_call(bbl, IPOINT_BEFORE, (AFUNPTR)slab_counter_add, IARG_FAST_ANALYSIS_CALL,
+            IARG_REG_VALUE, slab_reg, IARG_UINT32, slot, IARG_UINT32, c, IARG_END);
+    } else {
+        insert_call(bbl, IPOINT_BEFORE, (AFUNPTR)bbl_ins_count, IARG_FAST_ANALYSIS_CALL,
+            IARG_PTR, counter, IARG_UINT32, c, IARG_END);
+    }
+}
+
+// Drives the instruction clock from every basic block of the main executable
+VOID insert_clock_tick(BBL bbl)
+{
+    BBL_InsertIfCall(bbl, IPOINT_BEFORE, (AFUNPTR)clock_tick, IARG_FAST_ANALYSIS_CALL, IARG_UINT32, BBL_NumIns(bbl), IARG_END);
+    BBL_InsertThenCall(bbl, IPOINT_BEFORE, (AFUNPTR)clock_event, IARG_END);
+}
+
+VOID insert_window_tick(BBL bbl)
+{
+    BBL_InsertIfCall(bbl, IPOINT_BEFORE, (AFUNPTR)window_tick, IARG_FAST_ANALYSIS_CALL, IARG_UINT32, BBL_NumIns(bbl), IARG_END);
+    BBL_InsertThenCall(bbl, IPOINT_BEFORE, (AFUNPTR)window_event, IARG_END);
+}
+
+VOID insert_branch_counter(INS ins, branch_stat* branch)
+{
+    UINT32 taken_slot, count_slot;
+    bool per_thread = prof_per_thread_knob
+        && get_counter_slots(&(branch->branch_taken), &(branch->branch_count), &taken_slot, &count_slot);
+    ins_insert_fn insert_call = insert_collector_gate(ins, IPOINT_BEFORE);
+    if (per_thread) {
+        insert_call(ins, IPOINT_BEFORE, (AFUNPTR)slab_branch_outcome_count, IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, slab_reg,
+            IARG_UINT32, taken_slot, IARG_UINT32, count_slot, IARG_BRANCH_TAKEN, IARG_END);
+    } else {
+        insert_call(ins, IPOINT_BEFORE, (AFUNPTR)branch_outcome_count, IARG_FAST_ANALYSIS_CALL,
+            IARG_PTR, branch, IARG_BRANCH_TAKEN, IARG_END);
+    }
+}
+
 rtn_stat* map_get_rtn_stat(RTN rtn)
 {
     rtn_stat* stat;
@@ -130,7 +534,7 @@ rtn_stat* map_get_rtn_stat(RTN rtn)
         }
         // Create a new entry for this routine in the statistics map
         // stat = new rtn_stat({ IMG_Name(img), IMG_LowAddress(img), RTN_Name(rtn), RTN_Address(rtn), 0, 0 });
-        stat = new rtn_stat(RTN_Name(rtn), RTN_Address(rtn));
+        stat = new rtn_stat(RTN_Name(rtn), RTN_Address(rtn), RTN_Size(rtn));
         if (stat == nullptr) {
             return nullptr;
         }
@@ -149,19 +553,40 @@ branch_stat* set_new_branch_stat(rtn_stat* rtn_stat, ADDRINT branch_addr)
         return nullptr;
     }
     rtn_stat->branches.push_back(branch);
+    branch_map[branch_addr] = branch;
     return branch;
 }
 
-call_stat* set_new_call_stat(rtn_stat* rtn_stat, ADDRINT callee_addr, ADDRINT inst_call_addr)
+call_stat* set_new_call_stat(rtn_stat* rtn_stat, ADDRINT callee_addr, ADDRINT inst_call_addr, ADDRINT ret_addr)
 {
-    call_stat* call = new call_stat(callee_addr, inst_call_addr);
+    call_stat* call = new call_stat(callee_addr, inst_call_addr, ret_addr);
     if (call == nullptr) {
         return nullptr;
     }
     rtn_stat->rtn_calls.push_back(call);
+    call_map[inst_call_addr] = call;
     return call;
 }
 
+// An instruction can show up in several traces, reuse its statistics if it was already instrumented
+branch_stat* map_get_branch_stat(rtn_stat* rtn_stat, ADDRINT branch_addr)
+{
+    auto it = branch_map.find(branch_addr);
+    if (it != branch_map.end()) {
+        return it->second;
+    }
+    return set_new_branch_stat(rtn_stat, branch_addr);
+}
+
+call_stat* map_get_call_stat(rtn_stat* rtn_stat, ADDRINT callee_addr, ADDRINT inst_call_addr, ADDRINT ret_addr)
+{
+    auto it = call_map.find(inst_call_addr);
+    if (it != call_map.end()) {
+        return it->second;
+    }
+    return set_new_call_stat(rtn_stat, callee_addr, inst_call_addr, ret_addr);
+}
+
 // Function to check for multiple return instructions
 bool more_than_one_ret(INS ins, unsigned int& ret_count)
 {
@@ -252,47 +677,276 @@ inline_valid routine_inline_valid_result(RTN rtn)
     return VALID;
 }
 
+// Adds the branch and call collectors of a single instruction
+VOID instrument_collectors(INS ins, rtn_stat* stat)
+{
+    xed_category_enum_t ins_category = (xed_category_enum_t)INS_Category(ins);
+
+    if (ins_category == XED_CATEGORY_COND_BR) {
+        branch_stat* branch = map_get_branch_stat(stat, INS_Address(ins));
+        if (branch != nullptr) {
+            insert_branch_counter(ins, branch);
+            if (prof_bp_knob) {
+                instrument_branch_predictor(ins, stat, branch);
+            }
+        }
+    }
+    if (ins_category == XED_CATEGORY_CALL && INS_IsDirectControlFlow(ins)) {
+        call_stat* call = map_get_call_stat(stat, INS_DirectControlFlowTargetAddress(ins), INS_Address(ins), INS_NextAddress(ins));
+        if (call != nullptr) {
+            insert_collector_counter(ins, IPOINT_BEFORE, (AFUNPTR)call_site_count, &(call->call_count));
+        }
+    }
+    if (prof_indirect_knob && INS_IsIndirectControlFlow(ins) && !INS_IsRet(ins)) {
+        instrument_indirect_site(ins, stat);
+    }
+    if (prof_loops_knob) {
+        instrument_loop_ins(ins);
+    }
+    if (prof_dcache_knob) {
+        instrument_dcache(ins, stat);
+    }
+}
+
 VOID routine(RTN rtn, VOID* v)
 {
+    if (profile_window == WINDOW_DONE) {
+        return;
+    }
     rtn_stat* stat = map_get_rtn_stat(rtn);
     if (stat == nullptr) {
         return;
     }
     RTN_Open(rtn);
     stat->inline_valid = (routine_inline_valid_result(rtn) == VALID);
+    if (stat->block_hashes.empty()) {
+        rtn_fingerprint(rtn, stat->block_hashes);
+    }
+    if ((prof_edges_knob || prof_paths_knob) && stat->cfg == nullptr) {
+        stat->cfg = build_rtn_cfg(rtn, stat);
+    }
+    if (prof_edges_knob && stat->cfg != nullptr) {
+        instrument_rtn_edges(rtn, stat->cfg);
+    }
+    if (prof_paths_knob && stat->cfg != nullptr) {
+        instrument_rtn_paths(rtn, stat->cfg);
+    }
+    if (prof_loops_knob) {
+        find_rtn_loops(rtn, stat);
+    }
+    if (prof_cct_knob) {
+        instrument_rtn_cct(rtn, stat);
+    }
+    if (prof_time_knob) {
+        instrument_rtn_time(rtn, stat);
+    }
+    if (prof_tier_threshold_knob) {
+        // Cold routines only pay for the entry counter, trace() adds the rest once they are hot
+        insert_tier_counter(rtn, stat);
+        RTN_Close(rtn);
+        return;
+    }
     // Increment routine execution count at the routine's address
-    RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR)ins_count, IARG_PTR, &(stat->rtn_count), IARG_END);
+    insert_rtn_counter(rtn, &(stat->rtn_count));
     for (INS ins = RTN_InsHead(rtn); INS_Valid(ins); ins = INS_Next(ins)) {
-        xed_category_enum_t ins_category = (xed_category_enum_t)INS_Category(ins);
+        instrument_collectors(ins, stat);
+    }
+    RTN_Close(rtn);
+}
 
-        if (ins_category == XED_CATEGORY_COND_BR) {
-            branch_stat* branch = set_new_branch_stat(stat, INS_Address(ins));
-            if (branch != nullptr) {
-                INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)branch_taken_count, IARG_PTR, branch, IARG_BRANCH_TAKEN, IARG_END);
-            }
+// Sleeps in short steps so fini does not wait for the whole period, returns false when asked to exit
+bool window_sleep(UINT64 ms)
+{
+    for (UINT64 waited_ms = 0; waited_ms < ms; waited_ms += WINDOW_POLL_MS) {
+        if (window_thread_exit) {
+            return false;
         }
-        if (ins_category == XED_CATEGORY_CALL && INS_IsDirectControlFlow(ins)) {
-            call_stat* call = set_new_call_stat(stat, INS_DirectControlFlowTargetAddress(ins), INS_Address(ins));
-            if (call != nullptr) {
-                INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)ins_count, IARG_PTR, &(call->call_count), IARG_END);
-            }
+        PIN_Sleep(WINDOW_POLL_MS);
+    }
+    return !window_thread_exit;
+}
+
+// Timed window: opens the gate after the warm-up seconds and closes it after the window seconds.
+// The instrumentation stays in place, the gate keeps the collectors quiet after the window
+VOID window_thread(VOID* arg)
+{
+    if (!window_sleep(prof_skip_secs_knob.Value() * 1000ULL)) {
+        return;
+    }
+    profile_window = WINDOW_ON;
+    __atomic_and_fetch(&gate_closed, ~GATE_WINDOW, __ATOMIC_RELAXED);
+    if (!prof_window_secs_knob || !window_sleep(prof_window_secs_knob.Value() * 1000ULL)) {
+        return;
+    }
+    __atomic_or_fetch(&gate_closed, GATE_WINDOW, __ATOMIC_RELAXED);
+}
+
+VOID window_prepare_fini(VOID* v)
+{
+    if (!window_thread_running) {
+        return;
+    }
+    window_thread_exit = true;
+    PIN_WaitForThreadTermination(window_thread_uid, PIN_INFINITE_TIMEOUT, nullptr);
+}
+
+// Sets up the warm-up and the profiling window, returns false on a bad knob combination
+bool init_profile_window()
+{
+    if (window_by_ins() && window_by_secs()) {
+        cerr << "Error: use either the -prof_*_ins or the -prof_*_secs window knobs" << endl;
+        return false;
+    }
+    // These collectors do not go through the gate, they would still count the warm-up
+    bool ungated = prof_paths_knob || prof_loops_knob || prof_cct_knob || prof_time_knob || prof_bp_knob
+        || prof_icache_knob || prof_dcache_knob;
+    if ((window_by_ins() || window_by_secs()) && ungated) {
+        cerr << "Error: -prof_paths, -prof_loops, -prof_cct, -prof_time, -prof_bp, -prof_icache and -prof_dcache "
+             << "cannot be used with the -prof_skip_* and -prof_window_* knobs" << endl;
+        return false;
+    }
+    if (window_by_ins()) {
+        PIN_InitLock(&window_lock);
+        if (prof_skip_ins_knob) {
+            profile_window = WINDOW_SKIP;
+            gate_closed |= GATE_WINDOW;
+            window_countdown = prof_skip_ins_knob.Value();
+        } else {
+            window_countdown = prof_window_ins_knob.Value();
         }
     }
-    RTN_Close(rtn);
+    if (window_by_secs()) {
+        if (prof_skip_secs_knob) {
+            profile_window = WINDOW_SKIP;
+            gate_closed |= GATE_WINDOW;
+        }
+        if (PIN_SpawnInternalThread(window_thread, nullptr, 0, &window_thread_uid) == INVALID_THREADID) {
+            cerr << "Error: cannot start the profiling window thread" << endl;
+            return false;
+        }
+        window_thread_running = true;
+        PIN_AddPrepareForFiniFunction(window_prepare_fini, 0);
+    }
+    return true;
+}
+
+// The timer thread of a -prof_*_secs window does not survive fork, a forked child profiles its whole run
+VOID stop_window_after_fork()
+{
+    if (!window_thread_running) {
+        return;
+    }
+    window_thread_running = false;
+    window_thread_exit = true;
+    profile_window = WINDOW_ON;
+    __atomic_and_fetch(&gate_closed, ~GATE_WINDOW, __ATOMIC_RELAXED);
+}
+
+VOID main_image_load(IMG img, VOID* v)
+{
+    if (!IMG_IsMainExecutable(img)) {
+        return;
+    }
+    main_img_base = IMG_LowAddress(img);
+    main_img_high = IMG_HighAddress(img);
+    main_img_build_id = img_build_id(img);
+    if (main_img_build_id.empty()) {
+        cerr << "Warning: " << IMG_Name(img) << " has no build-id, -opt will look the routines up by name" << endl;
+    }
+}
+
+ADDRINT main_image_base()
+{
+    return main_img_base;
+}
+
+ADDRINT main_image_high()
+{
+    return main_img_high;
+}
+
+const string& main_image_build_id()
+{
+    return main_img_build_id;
+}
+
+// Finds the region of interest markers in every loaded image, they are usually in the main executable
+// but a marker library works too
+VOID roi_image_load(IMG img, VOID* v)
+{
+    RTN begin_rtn = RTN_FindByName(img, prof_roi_begin_knob.Value().c_str());
+    if (RTN_Valid(begin_rtn)) {
+        RTN_Open(begin_rtn);
+        RTN_InsertCall(begin_rtn, IPOINT_BEFORE, (AFUNPTR)roi_begin, IARG_END);
+        RTN_Close(begin_rtn);
+        roi_markers_found++;
+    }
+    RTN end_rtn = RTN_FindByName(img, prof_roi_end_knob.Value().c_str());
+    if (RTN_Valid(end_rtn)) {
+        RTN_Open(end_rtn);
+        RTN_InsertCall(end_rtn, IPOINT_BEFORE, (AFUNPTR)roi_end, IARG_END);
+        RTN_Close(end_rtn);
+        roi_markers_found++;
+    }
 }
 
 // Instrumentation function for tracing
 VOID trace(TRACE trace, VOID* v)
 {
+    if (profile_window == WINDOW_DONE) {
+        return;
+    }
+    if (prof_icache_knob) {
+        instrument_trace_icache(trace);
+    }
     RTN rtn = TRACE_Rtn(trace);
     rtn_stat* stat = map_get_rtn_stat(rtn);
     if (stat == nullptr) {
         return;
     }
+    if (collectors_sampled()) {
+        for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl)) {
+            insert_clock_tick(bbl);
+        }
+    }
+    if (window_by_ins()) {
+        for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl)) {
+            insert_window_tick(bbl);
+        }
+    }
+    if (prof_snapshot_ins_knob) {
+        for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl)) {
+            insert_snapshot_tick(bbl);
+        }
+    }
+    if (prof_cct_knob) {
+        for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl)) {
+            instrument_bbl_cct(bbl);
+        }
+    }
+    if (prof_tier_threshold_knob && !stat->hot) {
+        return;
+    }
     // Count instructions in the regular way
     for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl)) {
-        BBL_InsertCall(bbl, IPOINT_BEFORE, (AFUNPTR)bbl_count, IARG_PTR, &(stat->ins_count), IARG_UINT32, BBL_NumIns(bbl), IARG_END);
+        insert_bbl_counter(bbl, &(stat->ins_count), BBL_NumIns(bbl));
+        if (!prof_tier_threshold_knob) {
+            continue;
+        }
+        for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins)) {
+            instrument_collectors(ins, stat);
+        }
+    }
+}
+
+// Scales a count of a sampled collector back up to the whole run
+UINT64 scaled_count(UINT64 count)
+{
+    if (!collectors_sampled()) {
+        return count;
     }
+    UINT64 on = prof_sample_on_knob.Value();
+    return (UINT64)((double)count * (on + prof_sample_off_knob.Value()) / on);
 }
 
 UINT32 get_reorder_offset(rtn_stat* stat)
@@ -301,15 +955,19 @@ UINT32 get_reorder_offset(rtn_stat* stat)
     ADDRINT reorder_branch_addr = 0;
 
     for (auto it = stat->branches.begin(); it != stat->branches.end(); ++it) {
-        if ((*it)->branch_count == 0) {
+        UINT64 branch_taken = scaled_count((*it)->branch_taken);
+        UINT64 branch_count = scaled_count((*it)->branch_count);
+        if (branch_count == 0) {
             continue;
         }
-        if (((double)(*it)->branch_taken) / (*it)->branch_count < BRANCH_THRESHOLD) {
+        if (((double)branch_taken) / branch_count < BRANCH_THRESHOLD) {
             continue;
         }
-        if (max_count < (*it)->branch_count) {
+        // With the simulated predictor the branch that costs the most mispredictions wins
+        UINT64 branch_cost = prof_bp_knob ? (*it)->mispredicts : branch_count;
+        if (max_count < branch_cost) {
             reorder_branch_addr = (*it)->branch_addr;
-            max_count = (*it)->branch_count;
+            max_count = branch_cost;
         }
     }
     if (reorder_branch_addr == 0) {
@@ -333,10 +991,12 @@ UINT32 get_inline_offset(rtn_stat* stat, string* callee_name)
         if (!callee_stat->inline_valid) {
             continue;
         }
-        if (max_count < (*it)->call_count) {
+        // With the calling context tree a call site is as hot as the work its callee does when called from it
+        UINT64 call_count = prof_cct_knob ? cct_call_site_heat((*it)->ret_addr) : scaled_count((*it)->call_count);
+        if (max_count < call_count) {
             inline_call_addr = (*it)->inst_call_addr;
             callee_addr = (*it)->callee_addr;
-            max_count = (*it)->call_count;
+            max_count = call_count;
         }
     }
     if (inline_call_addr == 0) {
@@ -348,42 +1008,144 @@ UINT32 get_inline_offset(rtn_stat* stat, string* callee_name)
     return inline_call_addr - stat->rtn_addr;
 }
 
-// Finalization function
-VOID fini(INT32 code, VOID* v)
+// Sum of the instruction counts of all routines
+UINT64 total_ins_count()
 {
-    file_ptr = fopen(OUTPUT_FILE_NAME, "w");
+    UINT64 total = 0;
+    for (auto it = rtn_map.begin(); it != rtn_map.end(); ++it) {
+        total += it->second->ins_count;
+    }
+    return total;
+}
+
+// Appends the statistics of every routine seen so far
+VOID get_rtn_stats(vector<rtn_stat*>& stats)
+{
+    stats.reserve(stats.size() + rtn_map.size());
+    for (auto it = rtn_map.begin(); it != rtn_map.end(); ++it) {
+        stats.push_back(it->second);
+    }
+}
+
+// Picks the reorder and inline candidates of a routine and returns the optimization mode
+UINT16 get_rtn_candidates(rtn_stat* stat, UINT32* branch_offset, UINT32* inline_offset, string* callee_name)
+{
+    UINT16 opt_mode = 0;
+    *inline_offset = get_inline_offset(stat, callee_name);
+    *branch_offset = get_reorder_offset(stat);
+    if (*inline_offset) {
+        opt_mode |= OPT_INLINE;
+    }
+    if (*branch_offset) {
+        opt_mode |= OPT_REORDER;
+    }
+    return opt_mode;
+}
+
+// In delta mode the heat of a routine is its instruction count since the previous delta write
+UINT64 get_rtn_heat(rtn_stat* stat, bool delta)
+{
+    UINT64 heat = stat->ins_count;
+    if (delta) {
+        heat -= stat->snapshot_ins_count;
+        stat->snapshot_ins_count = stat->ins_count;
+    }
+    return heat;
+}
+
+// Writes the routine statistics in the -prof_csv or the binary format
+bool write_profile(const char* file_name, bool delta)
+{
+    if (prof_csv_knob) {
+        return write_profile_stat(file_name, delta);
+    }
+    return write_profile_bin(file_name, delta);
+}
+
+const char* profile_file_name()
+{
+    if (prof_follow_knob) {
+        return process_profile_name();
+    }
+    return prof_csv_knob ? OUTPUT_FILE_NAME : PROFILE_BIN_FILE_NAME;
+}
+
+// Writes the routine statistics and the optimization candidates
+bool write_profile_stat(const char* file_name, bool delta)
+{
+    file_ptr = fopen(file_name, "w");
     if (file_ptr == NULL) {
         cerr << "Error: opening a file" << endl;
-        return;
+        return false;
     }
     // Output statistics to the file
     for (auto it = rtn_map.begin(); it != rtn_map.end(); ++it) {
         rtn_stat* stat = it->second;
-        UINT16 opt_mode = 0;
         UINT32 rtn_inline_offset = 0;
         UINT32 rtn_branch_offset = 0;
         string inline_candidate_name = "";
-
-        rtn_inline_offset = get_inline_offset(stat, &inline_candidate_name);
-        rtn_branch_offset = get_reorder_offset(stat);
-
-        if (rtn_inline_offset) {
-            opt_mode |= OPT_INLINE;
-        }
-        if (rtn_branch_offset) {
-            opt_mode |= OPT_REORDER;
-        }
+        UINT16 opt_mode = get_rtn_candidates(stat, &rtn_branch_offset, &rtn_inline_offset, &inline_candidate_name);
+        UINT64 heat = get_rtn_heat(stat, delta);
         // Please check prof_rtn_stat struct
         fprintf(file_ptr, "%s,0x%lx,%lu,%hhu,%u,%u,%s\n",
             stat->rtn_name.c_str(),
             stat->rtn_addr,
-            stat->ins_count,
+            heat,
             opt_mode,
             rtn_branch_offset,
             rtn_inline_offset,
             inline_candidate_name.c_str());
     }
     fclose(file_ptr);
+    return true;
+}
+
+// Finalization function
+VOID fini(INT32 code, VOID* v)
+{
+    if (prof_roi_knob && roi_markers_found == 0) {
+        cerr << "Warning: no " << prof_roi_begin_knob.Value() << " or " << prof_roi_end_knob.Value()
+             << " marker was found, the profile is empty" << endl;
+    }
+    if (prof_per_thread_knob) {
+        merge_thread_slabs();
+    }
+    if (prof_cct_knob) {
+        fold_cct_profile();
+    }
+    if (!write_profile(profile_file_name(), false)) {
+        return;
+    }
+    // The other files are keyed by routine name and would be overwritten by every process of the tree,
+    // -prof_follow only allows the collectors that are saved in profile.bin
+    if (prof_follow_knob) {
+        merge_process_profiles();
+        return;
+    }
+    if (prof_edges_knob) {
+        write_edge_profile();
+    }
+    if (prof_paths_knob) {
+        write_path_profile();
+    }
+    if (prof_indirect_knob) {
+        write_indirect_profile();
+    }
+    if (prof_loops_knob) {
+        write_loop_profile();
+    }
+    if (prof_time_knob) {
+        write_time_profile();
+    }
+    if (prof_bp_knob) {
+        write_branch_profile();
+    }
+    if (prof_icache_knob) {
+        write_icache_profile();
+    }
+    if (prof_dcache_knob) {
+        write_load_profile();
+    }
 }
 
 // Main function
@@ -391,7 +1153,63 @@ int collect_profile_main(int argc, char* argv[])
 {
     // PIN_InitSymbols();
     rtn_map.reserve(RESERVED_SPACE);
+    branch_map.reserve(RESERVED_SPACE);
+    call_map.reserve(RESERVED_SPACE);
     // rtn_list.reserve(RESERVED_SPACE);
+    // Sampling starts with a burst
+    clock_countdown = prof_sample_on_knob.Value();
+    IMG_AddInstrumentFunction(main_image_load, 0);
+    if (prof_roi_knob) {
+        // Nothing is counted before the first region starts
+        gate_closed |= GATE_ROI;
+        PIN_InitLock(&roi_lock);
+        IMG_AddInstrumentFunction(roi_image_load, 0);
+    }
+    if (!init_profile_window()) {
+        return -1;
+    }
+    if (thread_state_needed()) {
+        thread_state_key = PIN_CreateThreadDataKey(nullptr);
+        thread_state_reg = PIN_ClaimToolRegister();
+        if (thread_state_key == INVALID_TLS_KEY || !REG_valid(thread_state_reg)) {
+            cerr << "Error: cannot allocate thread local storage for the profiler" << endl;
+            return -1;
+        }
+        PIN_AddThreadStartFunction(thread_start, 0);
+        PIN_AddThreadFiniFunction(thread_fini, 0);
+    }
+    if (prof_per_thread_knob) {
+        slab_reg = PIN_ClaimToolRegister();
+        if (!REG_valid(slab_reg)) {
+            cerr << "Error: cannot allocate a tool register for the counter slabs" << endl;
+            return -1;
+        }
+        PIN_InitLock(&slabs_lock);
+    }
+    if (prof_paths_knob) {
+        init_path_profile();
+    }
+    if (prof_cct_knob) {
+        init_cct_profile();
+    }
+    if (prof_bp_knob && !init_branch_predictor()) {
+        return -1;
+    }
+    if (prof_icache_knob) {
+        init_icache_sim();
+    }
+    if (!init_snapshots()) {
+        return -1;
+    }
+    if (!init_telemetry()) {
+        return -1;
+    }
+    if (!init_follow(argc, argv)) {
+        return -1;
+    }
+    if (prof_dcache_knob) {
+        init_dcache_sim();
+    }
     // Add trace instrumentation and finalization function
     TRACE_AddInstrumentFunction(trace, 0);
     RTN_AddInstrumentFunction(routine, 0);
@@ -0,0 +1,364 @@
+#ifndef PROFILE_HEADER
+#define PROFILE_HEADER
+#include "pin.H"
+#include "prof_rtn_stat.h"
+#include <string>
+#include <vector>
+
+/* ============================================================= */
+/* Profiler data structures shared by the profiling modules      */
+/* ============================================================= */
+
+// Structure to find potential reordering candidates
+struct branch_stat {
+    ADDRINT branch_addr;
+    UINT64 branch_taken; // the number of times we took the jump
+    UINT64 branch_count; // how many times we got to that branch
+    UINT64 mispredicts; // simulated mispredictions, only with -prof_bp
+
+    branch_stat(ADDRINT branch_addr)
+        : branch_addr(branch_addr)
+        , branch_taken(0)
+        , branch_count(0)
+        , mispredicts(0)
+    {
+    }
+};
+
+// Structure to find potential inline candidates
+struct call_stat {
+    ADDRINT callee_addr; // callee address
+    ADDRINT inst_call_addr; // instruction call address
+    ADDRINT ret_addr; // address of the instruction after the call
+    UINT64 call_count; // how many times we got to the function
+
+    call_stat(ADDRINT callee_addr, ADDRINT inst_call_addr, ADDRINT ret_addr)
+        : callee_addr(callee_addr)
+        , inst_call_addr(inst_call_addr)
+        , ret_addr(ret_addr)
+        , call_count(0)
+    {
+    }
+};
+
+struct rtn_cfg;
+
+// Structure to store statistics for a routine
+struct rtn_stat {
+    // string image_name;
+    // ADDRINT image_addr;
+    std::string rtn_name;
+    ADDRINT rtn_addr;
+    UINT64 rtn_count; // we will use this to figure out the percentage of calls the potential function
+    UINT64 ins_count; // used as a heat score for all of our routines
+    USIZE rtn_size;
+    bool inline_valid;
+    bool hot; // tiered profiling: the routine crossed the heat threshold and has the detailed instrumentation
+    bool timed; // in the list of routines timed by -prof_time
+    std::vector<branch_stat*> branches; // vector to record branches behavior per routine
+    std::vector<call_stat*> rtn_calls; // map of call instruction metadata
+    rtn_cfg* cfg; // static CFG with the block and edge counters, only built by the CFG based profilers
+    UINT64 incl_cycles; // TSC cycles from entry to return, only with -prof_time
+    UINT64 excl_cycles; // the inclusive cycles without the cycles of the main executable callees
+    UINT64 snapshot_ins_count; // ins_count at the previous delta snapshot
+    std::vector<prof_block_hash> block_hashes; // opcode fingerprint of the routine for stale profile matching
+
+    rtn_stat(std::string rtn_name, ADDRINT rtn_addr, USIZE rtn_size)
+        : rtn_name(rtn_name)
+        , rtn_addr(rtn_addr)
+        , rtn_count(0)
+        , ins_count(0)
+        , rtn_size(rtn_size)
+        , inline_valid(true)
+        , hot(false)
+        , timed(false)
+        , branches()
+        , rtn_calls()
+        , cfg(nullptr)
+        , incl_cycles(0)
+        , excl_cycles(0)
+        , snapshot_ins_count(0)
+        , block_hashes()
+    {
+    }
+};
+
+// Kinds of the edges in the static CFG
+enum cfg_edge_kind {
+    EDGE_FALLTHROUGH, // not taken conditional branch, or a block that runs into the next leader
+    EDGE_TAKEN, // taken conditional branch
+    EDGE_JUMP // direct unconditional jump
+};
+
+struct cfg_edge {
+    UINT32 src; // source block id
+    UINT32 dst; // destination block id
+    cfg_edge_kind kind;
+    bool derived; // the only way out of its source block, the count comes from the block count
+
+    cfg_edge(UINT32 src, UINT32 dst, cfg_edge_kind kind, bool derived)
+        : src(src)
+        , dst(dst)
+        , kind(kind)
+        , derived(derived)
+    {
+    }
+};
+
+struct cfg_block {
+    ADDRINT start_addr;
+    ADDRINT tail_addr; // address of the last instruction in the block
+    UINT32 ins_num;
+    std::vector<UINT32> succs; // ids of the outgoing edges
+    std::vector<UINT32> preds; // ids of the incoming edges
+
+    cfg_block(ADDRINT start_addr)
+        : start_addr(start_addr)
+        , tail_addr(start_addr)
+        , ins_num(0)
+        , succs()
+        , preds()
+    {
+    }
+};
+
+// Static CFG of a routine, block ids follow the block addresses and block 0 is the entry.
+// The counters are flat arrays indexed by block id and by edge id
+struct rtn_cfg {
+    rtn_stat* stat;
+    std::vector<cfg_block> blocks;
+    std::vector<cfg_edge> edges;
+    UINT64* block_counts;
+    UINT64* edge_counts;
+
+    rtn_cfg(rtn_stat* stat)
+        : stat(stat)
+        , blocks()
+        , edges()
+        , block_counts(nullptr)
+        , edge_counts(nullptr)
+    {
+    }
+};
+
+struct cct_node;
+
+// A shadow stack frame of the calling context tree
+struct cct_frame {
+    cct_node* node;
+    ADDRINT sp; // stack pointer at the routine entry
+
+    cct_frame(cct_node* node, ADDRINT sp)
+        : node(node)
+        , sp(sp)
+    {
+    }
+};
+
+// A shadow stack frame of the routine timer
+struct time_frame {
+    rtn_stat* stat;
+    ADDRINT sp; // stack pointer at the routine entry
+    UINT64 start; // TSC at the routine entry
+    UINT64 child_cycles; // inclusive cycles of the callees
+
+    time_frame(rtn_stat* stat, ADDRINT sp, UINT64 start)
+        : stat(stat)
+        , sp(sp)
+        , start(start)
+        , child_cycles(0)
+    {
+    }
+};
+
+// Per thread profiling state, stored in the thread's Pin TLS slot
+struct thread_state {
+    UINT64* slab; // private copy of every registered counter, only with -prof_per_thread
+    std::vector<ADDRINT> path_stack; // path registers of the callers, only with -prof_paths
+    std::vector<cct_frame> cct_stack; // current calling context, only with -prof_cct
+    std::vector<time_frame> time_stack; // running routines, only with -prof_time
+
+    thread_state(UINT64* slab)
+        : slab(slab)
+        , path_stack()
+        , cct_stack()
+        , time_stack()
+    {
+    }
+};
+
+// Set associative cache with LRU replacement, the ways of a set are kept from the most to the least recently used.
+// The line size is a power of two
+struct sim_cache {
+    UINT32 sets;
+    UINT32 assoc;
+    UINT32 line_shift;
+    std::vector<ADDRINT> tags; // sets * assoc, 0 is an empty way
+    UINT64 accesses;
+    UINT64 misses;
+
+    sim_cache(UINT32 size, UINT32 assoc, UINT32 line_size)
+        : sets(size / line_size / assoc)
+        , assoc(assoc)
+        , line_shift(__builtin_ctz(line_size))
+        , tags()
+        , accesses(0)
+        , misses(0)
+    {
+        if (sets == 0) {
+            sets = 1;
+        }
+        tags.assign((size_t)sets * assoc, 0);
+    }
+
+    // Returns whether the access hit
+    bool access(ADDRINT addr)
+    {
+        ADDRINT tag = (addr >> line_shift) + 1;
+        ADDRINT* set = &tags[(tag % sets) * assoc];
+        accesses++;
+        UINT32 way = 0;
+        while (way < assoc && set[way] != tag) {
+            way++;
+        }
+        bool hit = (way < assoc);
+        if (!hit) {
+            misses++;
+            way = assoc - 1; // evict the least recently used way
+        }
+        for (; way > 0; way--) {
+            set[way] = set[way - 1];
+        }
+        set[0] = tag;
+        return hit;
+    }
+};
+
+/* ============================================================= */
+/* Instrumentation helpers implemented in profile.cpp            */
+/* ============================================================= */
+
+// Tool register holding the thread_state of the current thread
+extern REG thread_state_reg;
+
+typedef VOID (*ins_insert_fn)(INS, IPOINT, AFUNPTR, ...);
+
+// Starts the if/then pair of a gated collector and returns the function that inserts its analysis call
+ins_insert_fn insert_collector_gate(INS ins, IPOINT ipoint);
+
+// Sums the per thread slabs into the shared counters, only with -prof_per_thread
+VOID merge_thread_slabs();
+
+// Gives an array of num counters consecutive slab slots, returns false if the slabs are full
+bool get_counter_slot_range(UINT64* counters, UINT32 num, UINT32* first_slot);
+
+// Zeroes the counters written to profile.bin
+VOID reset_profile_counters();
+
+VOID stop_window_after_fork();
+
+UINT64 total_ins_count();
+
+VOID get_rtn_stats(std::vector<rtn_stat*>& stats);
+
+// Low and high addresses and hex build-id of the main executable, the build-id is empty if it has none
+ADDRINT main_image_base();
+ADDRINT main_image_high();
+const std::string& main_image_build_id();
+
+// Writes profile_stat.csv rows to file_name, returns false if the file cannot be opened
+bool write_profile_stat(const char* file_name, bool delta);
+
+// Writes the routine statistics in the format picked by -prof_csv to file_name
+bool write_profile(const char* file_name, bool delta);
+const char* profile_file_name(); // profile.bin, or profile_stat.csv with -prof_csv
+
+UINT16 get_rtn_candidates(rtn_stat* stat, UINT32* branch_offset, UINT32* inline_offset, std::string* callee_name);
+UINT64 get_rtn_heat(rtn_stat* stat, bool delta);
+
+// Inserts a counting call of a collector at ipoint of ins. count_fn(UINT64* counter) is used with
+// shared counters, per thread slabs and the sampling gate are handled here
+VOID insert_collector_counter(INS ins, IPOINT ipoint, AFUNPTR count_fn, UINT64* counter);
+
+/* ============================================================= */
+/* Profiling modules                                             */
+/* ============================================================= */
+
+// edge_profile.cpp
+extern KNOB<BOOL> prof_edges_knob;
+rtn_cfg* build_rtn_cfg(RTN rtn, rtn_stat* stat); // expects an open routine
+VOID instrument_rtn_edges(RTN rtn, rtn_cfg* cfg); // expects an open routine
+INT32 find_cfg_block(rtn_cfg* cfg, ADDRINT addr); // id of the block starting at addr or -1
+VOID fill_derived_edge_counts(rtn_cfg* cfg);
+VOID write_edge_profile();
+
+// path_profile.cpp
+extern KNOB<BOOL> prof_paths_knob;
+VOID init_path_profile();
+VOID instrument_rtn_paths(RTN rtn, rtn_cfg* cfg); // expects an open routine
+VOID write_path_profile();
+
+// indirect_profile.cpp
+extern KNOB<BOOL> prof_indirect_knob;
+VOID instrument_indirect_site(INS ins, rtn_stat* stat);
+VOID write_indirect_profile();
+
+// loop_profile.cpp
+extern KNOB<BOOL> prof_loops_knob;
+VOID find_rtn_loops(RTN rtn, rtn_stat* stat); // expects an open routine
+VOID instrument_loop_ins(INS ins);
+VOID write_loop_profile();
+
+// cct_profile.cpp
+extern KNOB<BOOL> prof_cct_knob;
+VOID init_cct_profile();
+VOID cct_thread_start(thread_state* state, THREADID tid);
+VOID instrument_rtn_cct(RTN rtn, rtn_stat* stat); // expects an open routine
+VOID instrument_bbl_cct(BBL bbl);
+VOID fold_cct_profile();
+UINT64 cct_call_site_heat(ADDRINT ret_addr); // callee instructions in the context of the call site, after fold_cct_profile
+
+// time_profile.cpp
+extern KNOB<BOOL> prof_time_knob;
+VOID instrument_rtn_time(RTN rtn, rtn_stat* stat); // expects an open routine
+VOID time_thread_fini(thread_state* state);
+VOID write_time_profile();
+
+// branch_predictor.cpp
+extern KNOB<BOOL> prof_bp_knob;
+bool init_branch_predictor(); // false if -prof_bp_history is out of range
+VOID instrument_branch_predictor(INS ins, rtn_stat* stat, branch_stat* branch);
+VOID write_branch_profile();
+
+// icache_sim.cpp
+extern KNOB<BOOL> prof_icache_knob;
+VOID init_icache_sim();
+VOID instrument_trace_icache(TRACE trace);
+VOID write_icache_profile();
+
+// dcache_sim.cpp
+extern KNOB<BOOL> prof_dcache_knob;
+VOID init_dcache_sim();
+VOID instrument_dcache(INS ins, rtn_stat* stat);
+VOID write_load_profile();
+
+// profile_bin.cpp
+bool write_profile_bin(const char* file_name, bool delta);
+
+// snapshot.cpp
+extern KNOB<UINT64> prof_snapshot_ins_knob;
+bool init_snapshots(); // starts the snapshot thread when a -prof_snapshot_* knob asks for it
+VOID insert_snapshot_tick(BBL bbl); // drives the -prof_snapshot_ins clock from a main executable basic block
+VOID stop_snapshots_after_fork();
+
+// telemetry.cpp
+bool init_telemetry(); // maps the telemetry segment and starts its thread with -prof_telemetry
+VOID stop_telemetry_after_fork(); // unmaps the parent's segment in a forked child
+
+// multi_process.cpp
+extern KNOB<BOOL> prof_follow_knob;
+bool init_follow(int argc, char* argv[]); // registers the fork and exec callbacks with -prof_follow
+const char* process_profile_name(); // profile.bin of this process in the session directory
+VOID merge_process_profiles(); // only in the launched process
+
+#endif
@@ -0,0 +1,77 @@
+#include "pin.H"
+#include "prof_rtn_stat.h"
+#include "profile.h"
+#include "profile_bin.h"
+#include <iostream>
+
+using std::cerr;
+using std::endl;
+using std::string;
+using std::vector;
+
+static char edge_kind_char(cfg_edge_kind kind)
+{
+    switch (kind) {
+    case EDGE_TAKEN:
+        return 'T';
+    case EDGE_JUMP:
+        return 'J';
+    default:
+        return 'F';
+    }
+}
+
+// Writes profile.bin: the routine statistics and candidates of profile_stat.csv plus the branch and
+// call counters of every routine, and its blocks and edges with -prof_edges
+bool write_profile_bin(const char* file_name, bool delta)
+{
+    vector<rtn_stat*> stats;
+    get_rtn_stats(stats);
+    profile_bin_builder builder;
+    builder.build_id = main_image_build_id();
+    builder.image_base = main_image_base();
+    for (rtn_stat* stat : stats) {
+        UINT32 branch_offset = 0;
+        UINT32 inline_offset = 0;
+        string callee_name = "";
+        UINT16 opt_mode = get_rtn_candidates(stat, &branch_offset, &inline_offset, &callee_name);
+        profile_bin_rtn* rtn = builder.add_rtn(stat->rtn_name, stat->rtn_addr);
+        rtn->heat = get_rtn_heat(stat, delta);
+        rtn->rtn_count = stat->rtn_count;
+        rtn->incl_cycles = stat->incl_cycles;
+        rtn->excl_cycles = stat->excl_cycles;
+        rtn->opt_mode = opt_mode;
+        rtn->flags = stat->inline_valid ? 0 : PROFILE_BIN_NOT_INLINABLE;
+        rtn->branch_offset = branch_offset;
+        rtn->inline_offset = inline_offset;
+        rtn->inline_callee_name = builder.add_string(callee_name);
+
+        for (branch_stat* branch : stat->branches) {
+            builder.add_branch(branch->branch_addr - stat->rtn_addr, branch->branch_count, branch->branch_taken, branch->mispredicts);
+        }
+        for (call_stat* call : stat->rtn_calls) {
+            builder.add_call(call->inst_call_addr - stat->rtn_addr, call->callee_addr, call->call_count);
+        }
+        for (const prof_block_hash& block_hash : stat->block_hashes) {
+            builder.add_block_hash(block_hash.offset, block_hash.size, block_hash.hash);
+        }
+        rtn_cfg* cfg = stat->cfg;
+        if (!prof_edges_knob || cfg == nullptr || cfg->block_counts == nullptr) {
+            continue;
+        }
+        fill_derived_edge_counts(cfg);
+        for (UINT32 block_id = 0; block_id < cfg->blocks.size(); block_id++) {
+            builder.add_block(cfg->blocks[block_id].start_addr - stat->rtn_addr, cfg->blocks[block_id].tail_addr - stat->rtn_addr,
+                cfg->block_counts[block_id]);
+        }
+        for (UINT32 edge_id = 0; edge_id < cfg->edges.size(); edge_id++) {
+            builder.add_edge(cfg->edges[edge_id].src, cfg->edges[edge_id].dst, edge_kind_char(cfg->edges[edge_id].kind),
+                cfg->edge_counts[edge_id]);
+        }
+    }
+    if (!builder.write(file_name)) {
+        cerr << "Error: writing " << file_name << endl;
+        return false;
+    }
+    return true;
+}
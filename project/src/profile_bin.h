@@ -0,0 +1,297 @@
+#ifndef PROFILE_BIN_HEADER
+#define PROFILE_BIN_HEADER
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/* ============================================================= */
+/* Binary profile format (profile.bin)                           */
+/* ============================================================= */
+
+// Shared by the pintool and profile_convert, so it only uses fixed size types.
+// The file is a header followed by 8 byte aligned sections: the routine records, the branch, call,
+// block and edge arrays, and the string table. A routine record points at its slice of every array
+// and at its names in the string table, so a reader maps the file and reads the records through pointers
+// into the mapping without parsing any text. -opt copies them into its prof_rtn_stat table.
+// Routines are keyed by the build-id of the main executable and their offset from the image's low address,
+// which survive ASLR and do not depend on symbol names. The block fingerprints let -opt_stale match a profile
+// to another build. Bump PROFILE_BIN_VERSION whenever a record changes
+#define PROFILE_BIN_MAGIC 0x464f5250 // "PROF"
+#define PROFILE_BIN_VERSION 4
+#define PROFILE_BIN_NO_NAME 0 // string table offset of the empty string
+#define PROFILE_BIN_NOT_INLINABLE 0x1 // routine flag, the routine failed the inlining checks of -prof
+
+// Optimization mode bits of a routine, and the taken ratio from which a branch is a reorder candidate.
+// -prof, -opt and profile_merge all use these
+#define OPT_INLINE 0b01
+#define OPT_REORDER 0b10
+#define OPT_PROMOTE 0b100
+#define OPT_PREFETCH 0b1000
+#define OPT_ALL (OPT_INLINE | OPT_REORDER)
+#define BRANCH_THRESHOLD 0.8
+
+struct profile_bin_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t file_size;
+    uint32_t num_rtns;
+    uint32_t num_branches;
+    uint32_t num_calls;
+    uint32_t num_blocks;
+    uint32_t num_edges;
+    uint32_t strings_size;
+    uint32_t build_id; // string table offset of the hex GNU build-id, PROFILE_BIN_NO_NAME if the image has none
+    uint32_t num_hashes;
+    uint64_t image_base; // low address of the main executable in the profiled run
+    uint64_t rtns_off; // file offsets of the sections
+    uint64_t branches_off;
+    uint64_t calls_off;
+    uint64_t blocks_off;
+    uint64_t edges_off;
+    uint64_t hashes_off;
+    uint64_t strings_off;
+};
+
+struct profile_bin_rtn {
+    uint64_t image_offset; // routine address minus image_base
+    uint64_t addr; // routine address in the profiled run
+    uint64_t heat; // instruction count
+    uint64_t rtn_count;
+    uint64_t incl_cycles; // 0 without -prof_time
+    uint64_t excl_cycles;
+    uint32_t name; // string table offsets
+    uint32_t inline_callee_name;
+    uint32_t branch_offset; // reorder candidate, 0 if none
+    uint32_t inline_offset; // inline candidate, 0 if none
+    uint32_t first_branch; // slices of the arrays
+    uint32_t num_branches;
+    uint32_t first_call;
+    uint32_t num_calls;
+    uint32_t first_block;
+    uint32_t num_blocks; // blocks and edges only with -prof_edges
+    uint32_t first_edge;
+    uint32_t num_edges;
+    uint32_t first_hash;
+    uint32_t num_hashes;
+    uint16_t opt_mode;
+    uint16_t flags;
+    uint16_t pad[2];
+};
+
+struct profile_bin_branch {
+    uint32_t offset;
+    uint32_t pad;
+    uint64_t count;
+    uint64_t taken;
+    uint64_t mispredicts; // 0 without -prof_bp
+};
+
+struct profile_bin_call {
+    uint32_t offset;
+    uint32_t pad;
+    uint64_t callee_addr;
+    uint64_t count;
+};
+
+struct profile_bin_block {
+    uint32_t start_offset;
+    uint32_t tail_offset;
+    uint64_t count;
+};
+
+struct profile_bin_edge {
+    uint32_t src; // block index within the routine
+    uint32_t dst;
+    char kind; // T taken, F fallthrough, J jump
+    char pad[7];
+    uint64_t count;
+};
+
+// Opcode hash of a basic block, in address order
+struct profile_bin_block_hash {
+    uint32_t offset;
+    uint32_t size; // bytes
+    uint32_t hash;
+    uint32_t pad;
+};
+
+// Checks that a section of num records of record_size bytes is 8 byte aligned and lies inside the file.
+// The offset is compared on its own first, so a huge offset cannot wrap the sum around
+inline bool profile_bin_section_valid(uint64_t off, uint64_t num, uint64_t record_size, uint64_t file_size)
+{
+    return off % 8 == 0 && off <= file_size && num * record_size <= file_size - off;
+}
+
+// Checks the header and that every section lies inside a file of file_size bytes
+inline bool profile_bin_valid(const profile_bin_header* header, uint64_t file_size)
+{
+    if (file_size < sizeof(profile_bin_header) || header->magic != PROFILE_BIN_MAGIC
+        || header->version != PROFILE_BIN_VERSION || header->file_size != file_size) {
+        return false;
+    }
+    return profile_bin_section_valid(header->rtns_off, header->num_rtns, sizeof(profile_bin_rtn), file_size)
+        && profile_bin_section_valid(header->branches_off, header->num_branches, sizeof(profile_bin_branch), file_size)
+        && profile_bin_section_valid(header->calls_off, header->num_calls, sizeof(profile_bin_call), file_size)
+        && profile_bin_section_valid(header->blocks_off, header->num_blocks, sizeof(profile_bin_block), file_size)
+        && profile_bin_section_valid(header->edges_off, header->num_edges, sizeof(profile_bin_edge), file_size)
+        && profile_bin_section_valid(header->hashes_off, header->num_hashes, sizeof(profile_bin_block_hash), file_size)
+        && profile_bin_section_valid(header->strings_off, header->strings_size, 1, file_size)
+        && header->strings_size > 0 && ((const char*)header)[header->strings_off + header->strings_size - 1] == '\0'
+        && header->build_id < header->strings_size;
+}
+
+// Checks that the slices and the names of a routine record lie inside their sections
+inline bool profile_bin_rtn_valid(const profile_bin_header* header, const profile_bin_rtn* rtn)
+{
+    return (uint64_t)rtn->first_branch + rtn->num_branches <= header->num_branches
+        && (uint64_t)rtn->first_call + rtn->num_calls <= header->num_calls
+        && (uint64_t)rtn->first_block + rtn->num_blocks <= header->num_blocks
+        && (uint64_t)rtn->first_edge + rtn->num_edges <= header->num_edges
+        && (uint64_t)rtn->first_hash + rtn->num_hashes <= header->num_hashes
+        && rtn->name < header->strings_size && rtn->inline_callee_name < header->strings_size;
+}
+
+// Collects the records of a profile and writes them out as one profile.bin image
+struct profile_bin_builder {
+    std::vector<profile_bin_rtn> rtns;
+    std::vector<profile_bin_branch> branches;
+    std::vector<profile_bin_call> calls;
+    std::vector<profile_bin_block> blocks;
+    std::vector<profile_bin_edge> edges;
+    std::vector<profile_bin_block_hash> hashes;
+    std::string strings;
+    std::unordered_map<std::string, uint32_t> string_offsets; // names are stored once
+    std::string build_id;
+    uint64_t image_base;
+
+    profile_bin_builder()
+        : strings(1, '\0') // offset 0 is the empty string
+        , image_base(0)
+    {
+    }
+
+    uint32_t add_string(const std::string& s)
+    {
+        if (s.empty()) {
+            return PROFILE_BIN_NO_NAME;
+        }
+        auto it = string_offsets.find(s);
+        if (it != string_offsets.end()) {
+            return it->second;
+        }
+        uint32_t offset = strings.size();
+        strings.append(s.c_str(), s.size() + 1);
+        string_offsets[s] = offset;
+        return offset;
+    }
+
+    // Starts a routine record, the arrays added after it until the next one belong to it
+    profile_bin_rtn* add_rtn(const std::string& name, uint64_t addr)
+    {
+        profile_bin_rtn rtn;
+        memset(&rtn, 0, sizeof(rtn));
+        rtn.name = add_string(name);
+        rtn.addr = addr;
+        rtn.image_offset = addr - image_base;
+        rtn.first_branch = branches.size();
+        rtn.first_call = calls.size();
+        rtn.first_block = blocks.size();
+        rtn.first_edge = edges.size();
+        rtn.first_hash = hashes.size();
+        rtns.push_back(rtn);
+        return &rtns.back();
+    }
+
+    void add_branch(uint32_t offset, uint64_t count, uint64_t taken, uint64_t mispredicts)
+    {
+        profile_bin_branch branch = { offset, 0, count, taken, mispredicts };
+        branches.push_back(branch);
+        rtns.back().num_branches++;
+    }
+
+    void add_call(uint32_t offset, uint64_t callee_addr, uint64_t count)
+    {
+        profile_bin_call call = { offset, 0, callee_addr, count };
+        calls.push_back(call);
+        rtns.back().num_calls++;
+    }
+
+    void add_block(uint32_t start_offset, uint32_t tail_offset, uint64_t count)
+    {
+        profile_bin_block block = { start_offset, tail_offset, count };
+        blocks.push_back(block);
+        rtns.back().num_blocks++;
+    }
+
+    void add_edge(uint32_t src, uint32_t dst, char kind, uint64_t count)
+    {
+        profile_bin_edge edge;
+        memset(&edge, 0, sizeof(edge));
+        edge.src = src;
+        edge.dst = dst;
+        edge.kind = kind;
+        edge.count = count;
+        edges.push_back(edge);
+        rtns.back().num_edges++;
+    }
+
+    void add_block_hash(uint32_t offset, uint32_t size, uint32_t hash)
+    {
+        profile_bin_block_hash block_hash = { offset, size, hash, 0 };
+        hashes.push_back(block_hash);
+        rtns.back().num_hashes++;
+    }
+
+    static uint64_t align(uint64_t off)
+    {
+        return (off + 7) & ~(uint64_t)7;
+    }
+
+    // Returns false if the file cannot be written
+    bool write(const char* file_name)
+    {
+        profile_bin_header header;
+        memset(&header, 0, sizeof(header));
+        header.magic = PROFILE_BIN_MAGIC;
+        header.version = PROFILE_BIN_VERSION;
+        header.build_id = add_string(build_id);
+        header.image_base = image_base;
+        header.num_rtns = rtns.size();
+        header.num_branches = branches.size();
+        header.num_calls = calls.size();
+        header.num_blocks = blocks.size();
+        header.num_edges = edges.size();
+        header.num_hashes = hashes.size();
+        header.strings_size = strings.size();
+        header.rtns_off = align(sizeof(header));
+        header.branches_off = align(header.rtns_off + rtns.size() * sizeof(profile_bin_rtn));
+        header.calls_off = align(header.branches_off + branches.size() * sizeof(profile_bin_branch));
+        header.blocks_off = align(header.calls_off + calls.size() * sizeof(profile_bin_call));
+        header.edges_off = align(header.blocks_off + blocks.size() * sizeof(profile_bin_block));
+        header.hashes_off = align(header.edges_off + edges.size() * sizeof(profile_bin_edge));
+        header.strings_off = align(header.hashes_off + hashes.size() * sizeof(profile_bin_block_hash));
+        header.file_size = header.strings_off + strings.size();
+
+        std::vector<char> image(header.file_size, 0);
+        memcpy(&image[0], &header, sizeof(header));
+        memcpy(&image[header.rtns_off], rtns.data(), rtns.size() * sizeof(profile_bin_rtn));
+        memcpy(&image[header.branches_off], branches.data(), branches.size() * sizeof(profile_bin_branch));
+        memcpy(&image[header.calls_off], calls.data(), calls.size() * sizeof(profile_bin_call));
+        memcpy(&image[header.blocks_off], blocks.data(), blocks.size() * sizeof(profile_bin_block));
+        memcpy(&image[header.edges_off], edges.data(), edges.size() * sizeof(profile_bin_edge));
+        memcpy(&image[header.hashes_off], hashes.data(), hashes.size() * sizeof(profile_bin_block_hash));
+        memcpy(&image[header.strings_off], strings.data(), strings.size());
+
+        FILE* file_ptr = fopen(file_name, "wb");
+        if (file_ptr == NULL) {
+            return false;
+        }
+        bool written = (fwrite(image.data(), 1, image.size(), file_ptr) == image.size());
+        return (fclose(file_ptr) == 0) && written;
+    }
+};
+
+#endif
@@ -0,0 +1,279 @@
+#ifndef PROFILE_MERGE_HEADER
+#define PROFILE_MERGE_HEADER
+#include "profile_bin.h"
+#include <algorithm>
+#include <fcntl.h>
+#include <map>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <tuple>
+#include <unistd.h>
+
+/* ============================================================= */
+/* Merging of profile.bin files                                  */
+/* ============================================================= */
+
+// Shared by profile_merge and the -prof_follow aggregation of the pintool. Routines of the profiles of one build
+// are matched by image offset and their counts are summed as doubles so the inputs can be scaled by a weight,
+// then the reorder and inline candidates are picked again from the merged counts with the rules of -prof
+
+struct merged_branch {
+    double count;
+    double taken;
+    double mispredicts;
+};
+
+struct merged_rtn {
+    std::string name;
+    double heat;
+    double rtn_count;
+    double incl_cycles;
+    double excl_cycles;
+    bool not_inlinable;
+    std::map<uint32_t, merged_branch> branches; // by offset
+    std::map<std::pair<uint32_t, uint64_t>, double> calls; // by call offset and callee image offset
+    std::vector<profile_bin_block> blocks; // the block layout of the first input that has one
+    std::vector<double> block_counts;
+    std::map<std::tuple<uint32_t, uint32_t, char>, double> edges;
+    std::vector<profile_bin_block_hash> hashes; // fingerprint of the first input that has one
+
+    merged_rtn()
+        : heat(0)
+        , rtn_count(0)
+        , incl_cycles(0)
+        , excl_cycles(0)
+        , not_inlinable(false)
+    {
+    }
+};
+
+// Routines are keyed by their image offset, which all runs of one build share
+typedef std::unordered_map<uint64_t, merged_rtn> merged_profile;
+
+// Maps a profile.bin read only, returns nullptr with a warning if it is missing or not a valid profile
+inline const char* map_profile_bin(const char* file_name, size_t* file_size)
+{
+    int fd = open(file_name, O_RDONLY);
+    struct stat file_stat;
+    if (fd < 0 || fstat(fd, &file_stat) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        fprintf(stderr, "Warning: cannot open %s, skipping it\n", file_name);
+        return nullptr;
+    }
+    *file_size = file_stat.st_size;
+    void* addr = (*file_size != 0) ? mmap(NULL, *file_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (addr == MAP_FAILED) {
+        fprintf(stderr, "Warning: cannot map %s, skipping it\n", file_name);
+        return nullptr;
+    }
+    if (!profile_bin_valid((const profile_bin_header*)addr, *file_size)) {
+        fprintf(stderr, "Warning: %s is not a version %d profile, skipping it\n", file_name, PROFILE_BIN_VERSION);
+        munmap(addr, *file_size);
+        return nullptr;
+    }
+    return (const char*)addr;
+}
+
+// Build-id string of a mapped profile.bin
+inline const char* profile_bin_build_id(const char* base)
+{
+    const profile_bin_header* header = (const profile_bin_header*)base;
+    return base + header->strings_off + header->build_id;
+}
+
+// Adds a mapped profile.bin to merged with every count multiplied by scale, file_name is only for the warnings
+inline void merge_profile_bin(merged_profile& merged, const char* base, double scale, const char* file_name)
+{
+    const profile_bin_header* header = (const profile_bin_header*)base;
+    const profile_bin_rtn* rtns = (const profile_bin_rtn*)(base + header->rtns_off);
+    const profile_bin_branch* branches = (const profile_bin_branch*)(base + header->branches_off);
+    const profile_bin_call* calls = (const profile_bin_call*)(base + header->calls_off);
+    const profile_bin_block* blocks = (const profile_bin_block*)(base + header->blocks_off);
+    const profile_bin_edge* edges = (const profile_bin_edge*)(base + header->edges_off);
+    const profile_bin_block_hash* hashes = (const profile_bin_block_hash*)(base + header->hashes_off);
+    const char* strings = base + header->strings_off;
+
+    for (uint32_t i = 0; i < header->num_rtns; i++) {
+        const profile_bin_rtn* rtn = &rtns[i];
+        if (!profile_bin_rtn_valid(header, rtn)) {
+            fprintf(stderr, "Warning: skipping a malformed routine record in %s\n", file_name);
+            continue;
+        }
+        merged_rtn& stat = merged[rtn->image_offset];
+        if (stat.name.empty()) {
+            stat.name = strings + rtn->name;
+        }
+        stat.heat += rtn->heat * scale;
+        stat.rtn_count += rtn->rtn_count * scale;
+        stat.incl_cycles += rtn->incl_cycles * scale;
+        stat.excl_cycles += rtn->excl_cycles * scale;
+        stat.not_inlinable |= (rtn->flags & PROFILE_BIN_NOT_INLINABLE) != 0;
+        for (uint32_t j = rtn->first_branch; j < rtn->first_branch + rtn->num_branches; j++) {
+            merged_branch& branch = stat.branches[branches[j].offset];
+            branch.count += branches[j].count * scale;
+            branch.taken += branches[j].taken * scale;
+            branch.mispredicts += branches[j].mispredicts * scale;
+        }
+        for (uint32_t j = rtn->first_call; j < rtn->first_call + rtn->num_calls; j++) {
+            // The callee address moves with the image base of every run
+            uint64_t callee_offset = calls[j].callee_addr - header->image_base;
+            stat.calls[std::make_pair(calls[j].offset, callee_offset)] += calls[j].count * scale;
+        }
+        if (stat.blocks.empty() && rtn->num_blocks) {
+            stat.blocks.assign(blocks + rtn->first_block, blocks + rtn->first_block + rtn->num_blocks);
+            stat.block_counts.assign(rtn->num_blocks, 0);
+        }
+        // Edges refer to blocks by index, so only inputs with the same block layout are summed
+        if (stat.blocks.size() == rtn->num_blocks) {
+            for (uint32_t j = 0; j < rtn->num_blocks; j++) {
+                stat.block_counts[j] += blocks[rtn->first_block + j].count * scale;
+            }
+            for (uint32_t j = rtn->first_edge; j < rtn->first_edge + rtn->num_edges; j++) {
+                stat.edges[std::make_tuple(edges[j].src, edges[j].dst, edges[j].kind)] += edges[j].count * scale;
+            }
+        }
+        if (stat.hashes.empty()) {
+            stat.hashes.assign(hashes + rtn->first_hash, hashes + rtn->first_hash + rtn->num_hashes);
+        }
+    }
+}
+
+// Adds another merged profile into merged, partial is left empty or half moved
+inline void merge_profiles(merged_profile& merged, merged_profile& partial)
+{
+    for (auto it = partial.begin(); it != partial.end(); ++it) {
+        auto found = merged.find(it->first);
+        if (found == merged.end()) {
+            merged.emplace(it->first, std::move(it->second));
+            continue;
+        }
+        merged_rtn& stat = found->second;
+        merged_rtn& other = it->second;
+        stat.heat += other.heat;
+        stat.rtn_count += other.rtn_count;
+        stat.incl_cycles += other.incl_cycles;
+        stat.excl_cycles += other.excl_cycles;
+        stat.not_inlinable |= other.not_inlinable;
+        for (auto branch = other.branches.begin(); branch != other.branches.end(); ++branch) {
+            merged_branch& sum = stat.branches[branch->first];
+            sum.count += branch->second.count;
+            sum.taken += branch->second.taken;
+            sum.mispredicts += branch->second.mispredicts;
+        }
+        for (auto call = other.calls.begin(); call != other.calls.end(); ++call) {
+            stat.calls[call->first] += call->second;
+        }
+        if (stat.blocks.empty()) {
+            stat.blocks.swap(other.blocks);
+            stat.block_counts.swap(other.block_counts);
+            stat.edges.swap(other.edges);
+        } else if (stat.blocks.size() == other.blocks.size()) {
+            for (size_t j = 0; j < other.block_counts.size(); j++) {
+                stat.block_counts[j] += other.block_counts[j];
+            }
+            for (auto edge = other.edges.begin(); edge != other.edges.end(); ++edge) {
+                stat.edges[edge->first] += edge->second;
+            }
+        }
+        if (stat.hashes.empty()) {
+            stat.hashes.swap(other.hashes);
+        }
+    }
+}
+
+inline uint64_t round_count(double count)
+{
+    return (uint64_t)(count + 0.5);
+}
+
+// The taken branch with the most mispredictions, or executions without -prof_bp, as in get_reorder_offset
+inline uint32_t merged_reorder_offset(const merged_rtn& stat)
+{
+    bool has_mispredicts = false;
+    for (auto it = stat.branches.begin(); it != stat.branches.end(); ++it) {
+        has_mispredicts |= it->second.mispredicts > 0;
+    }
+    double max_cost = 0;
+    uint32_t reorder_offset = 0;
+    for (auto it = stat.branches.begin(); it != stat.branches.end(); ++it) {
+        const merged_branch& branch = it->second;
+        if (branch.count == 0 || branch.taken / branch.count < BRANCH_THRESHOLD) {
+            continue;
+        }
+        double cost = has_mispredicts ? branch.mispredicts : branch.count;
+        if (max_cost < cost) {
+            reorder_offset = it->first;
+            max_cost = cost;
+        }
+    }
+    return reorder_offset;
+}
+
+// The hottest call of an inlinable routine, as in get_inline_offset
+inline uint32_t merged_inline_offset(const merged_rtn& stat, const merged_profile& merged, std::string* callee_name)
+{
+    double max_count = 0;
+    uint32_t inline_offset = 0;
+    for (auto it = stat.calls.begin(); it != stat.calls.end(); ++it) {
+        auto callee = merged.find(it->first.second);
+        if (callee == merged.end() || callee->second.not_inlinable) {
+            continue;
+        }
+        if (max_count < it->second) {
+            inline_offset = it->first.first;
+            *callee_name = callee->second.name;
+            max_count = it->second;
+        }
+    }
+    return inline_offset;
+}
+
+inline bool write_merged(const merged_profile& merged, const std::string& build_id, uint64_t image_base, const char* out_name)
+{
+    std::vector<uint64_t> offsets;
+    offsets.reserve(merged.size());
+    for (auto it = merged.begin(); it != merged.end(); ++it) {
+        offsets.push_back(it->first);
+    }
+    std::sort(offsets.begin(), offsets.end());
+
+    profile_bin_builder builder;
+    builder.build_id = build_id;
+    builder.image_base = image_base;
+    for (uint64_t offset : offsets) {
+        const merged_rtn& stat = merged.at(offset);
+        std::string callee_name;
+        profile_bin_rtn* rtn = builder.add_rtn(stat.name, image_base + offset);
+        rtn->heat = round_count(stat.heat);
+        rtn->rtn_count = round_count(stat.rtn_count);
+        rtn->incl_cycles = round_count(stat.incl_cycles);
+        rtn->excl_cycles = round_count(stat.excl_cycles);
+        rtn->branch_offset = merged_reorder_offset(stat);
+        rtn->inline_offset = merged_inline_offset(stat, merged, &callee_name);
+        rtn->inline_callee_name = builder.add_string(callee_name);
+        rtn->opt_mode = (rtn->branch_offset ? OPT_REORDER : 0) | (rtn->inline_offset ? OPT_INLINE : 0);
+        rtn->flags = stat.not_inlinable ? PROFILE_BIN_NOT_INLINABLE : 0;
+        for (auto it = stat.branches.begin(); it != stat.branches.end(); ++it) {
+            builder.add_branch(it->first, round_count(it->second.count), round_count(it->second.taken),
+                round_count(it->second.mispredicts));
+        }
+        for (auto it = stat.calls.begin(); it != stat.calls.end(); ++it) {
+            builder.add_call(it->first.first, image_base + it->first.second, round_count(it->second));
+        }
+        for (size_t j = 0; j < stat.blocks.size(); j++) {
+            builder.add_block(stat.blocks[j].start_offset, stat.blocks[j].tail_offset, round_count(stat.block_counts[j]));
+        }
+        for (auto it = stat.edges.begin(); it != stat.edges.end(); ++it) {
+            builder.add_edge(std::get<0>(it->first), std::get<1>(it->first), std::get<2>(it->first), round_count(it->second));
+        }
+        for (const profile_bin_block_hash& hash : stat.hashes) {
+            builder.add_block_hash(hash.offset, hash.size, hash.hash);
+        }
+    }
+    return builder.write(out_name);
+}
+
+#endif
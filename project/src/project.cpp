@@ -1,12 +1,16 @@
 #include "project.h"
 #include "pin.H"
 #include "prof_rtn_stat.h"
+#include "profile_bin.h"
 #include <fcntl.h>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <set>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <unordered_map>
 
 using std::cerr;
@@ -19,10 +23,21 @@ using std::unordered_map;
 
 unordered_map<string, prof_rtn_stat*> rtn_map;
 multiset<prof_rtn_stat*, rtn_stat_comp> rtn_heat_set;
+unordered_map<ADDRINT, prof_rtn_stat*> rtn_offset_map;
+static string profile_build_id; // from profile.bin, empty for csv profiles
+static bool by_image_offset = false;
+static ADDRINT image_base = 0;
+
+#define NT_GNU_BUILD_ID_TYPE 3
+#define BUILD_ID_SECTION ".note.gnu.build-id"
 
 KNOB<BOOL> prof_knob(KNOB_MODE_WRITEONCE, "pintool", "prof", "0", "run profiling and save candidates for reordering and inlining optimizations to the file profile_stat.csv");
 KNOB<BOOL> opt_knob(KNOB_MODE_WRITEONCE, "pintool", "opt", "0", "run in probe mode and generate the binary code for the optimized binary");
+KNOB<BOOL> opt_csv_knob(KNOB_MODE_WRITEONCE, "pintool", "opt_csv", "0", "read the routine statistics from profile_stat.csv instead of profile.bin");
+KNOB<BOOL> opt_cycle_heat_knob(KNOB_MODE_WRITEONCE, "pintool", "opt_cycle_heat", "0", "rank the routines by their exclusive cycles from profile_cycles.csv instead of their instruction count");
 void check_opt_mode(UINT16* opt_mode);
+void print_profile_map();
+bool use_cycle_heat();
 
 void construct_profile_map(std::ifstream& profiling_file)
 {
@@ -52,6 +67,11 @@ void construct_profile_map(std::ifstream& profiling_file)
         rtn_map.insert({ prof_stat->rtn_name, prof_stat });
         rtn_heat_set.insert(prof_stat);
     }
+    print_profile_map();
+}
+
+void print_profile_map()
+{
     for (auto it = rtn_heat_set.begin(); it != rtn_heat_set.end(); ++it) {
         cout << "name: " << (*it)->rtn_name << " addr: 0x" << std::hex << (*it)->rtn_addr << std::dec
              << " heat: " << (*it)->heat << " opt_mode: " << (*it)->opt_mode << " branch_offset: "
@@ -60,6 +80,426 @@ void construct_profile_map(std::ifstream& profiling_file)
     }
 }
 
+// Fills the profile map from profile.bin. The file is mapped and its fixed size records are copied
+// field by field, there is no text to parse. Returns false if the file is missing or malformed
+bool construct_profile_bin(const char* file_name)
+{
+    int fd = open(file_name, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || file_stat.st_size < (off_t)sizeof(profile_bin_header)) {
+        close(fd);
+        cerr << file_name << " is not a profile." << endl;
+        return false;
+    }
+    size_t file_size = file_stat.st_size;
+    void* addr = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        cerr << "Error: cannot map " << file_name << endl;
+        return false;
+    }
+    const char* base = (const char*)addr;
+    const profile_bin_header* header = (const profile_bin_header*)base;
+    if (!profile_bin_valid(header, file_size)) {
+        cerr << file_name << " is not a version " << PROFILE_BIN_VERSION << " profile." << endl;
+        munmap(addr, file_size);
+        return false;
+    }
+    const profile_bin_rtn* rtns = (const profile_bin_rtn*)(base + header->rtns_off);
+    const profile_bin_branch* branches = (const profile_bin_branch*)(base + header->branches_off);
+    const profile_bin_call* calls = (const profile_bin_call*)(base + header->calls_off);
+    const profile_bin_block* blocks = (const profile_bin_block*)(base + header->blocks_off);
+    const profile_bin_edge* edges = (const profile_bin_edge*)(base + header->edges_off);
+    const profile_bin_block_hash* hashes = (const profile_bin_block_hash*)(base + header->hashes_off);
+    const char* strings = base + header->strings_off;
+    profile_build_id = strings + header->build_id;
+    rtn_map.reserve(header->num_rtns);
+    rtn_offset_map.reserve(header->num_rtns);
+    for (UINT32 i = 0; i < header->num_rtns; i++) {
+        const profile_bin_rtn* rtn = &rtns[i];
+        if (!profile_bin_rtn_valid(header, rtn)) {
+            cerr << "Warning: skipping a malformed routine record of " << file_name << endl;
+            continue;
+        }
+        prof_rtn_stat* prof_stat = new prof_rtn_stat();
+        prof_stat->rtn_name = strings + rtn->name;
+        prof_stat->rtn_addr = rtn->addr;
+        prof_stat->image_offset = rtn->image_offset;
+        prof_stat->heat = rtn->heat;
+        prof_stat->incl_cycles = rtn->incl_cycles;
+        prof_stat->excl_cycles = rtn->excl_cycles;
+        prof_stat->opt_mode = rtn->opt_mode;
+        check_opt_mode(&(prof_stat->opt_mode));
+        prof_stat->rtn_branch_offset = rtn->branch_offset;
+        prof_stat->rtn_inline_offset = rtn->inline_offset;
+        prof_stat->inline_callee_name = strings + rtn->inline_callee_name;
+        prof_stat->branches.resize(rtn->num_branches);
+        for (UINT32 j = 0; j < rtn->num_branches; j++) {
+            const profile_bin_branch* branch = &branches[rtn->first_branch + j];
+            prof_stat->branches[j] = { branch->offset, branch->count, branch->taken, branch->mispredicts };
+        }
+        prof_stat->calls.resize(rtn->num_calls);
+        for (UINT32 j = 0; j < rtn->num_calls; j++) {
+            const profile_bin_call* call = &calls[rtn->first_call + j];
+            prof_stat->calls[j] = { call->offset, (ADDRINT)call->callee_addr, call->count };
+        }
+        prof_stat->blocks.resize(rtn->num_blocks);
+        for (UINT32 j = 0; j < rtn->num_blocks; j++) {
+            const profile_bin_block* block = &blocks[rtn->first_block + j];
+            prof_stat->blocks[j] = { block->start_offset, block->tail_offset, block->count };
+        }
+        prof_stat->edges.resize(rtn->num_edges);
+        for (UINT32 j = 0; j < rtn->num_edges; j++) {
+            const profile_bin_edge* edge = &edges[rtn->first_edge + j];
+            prof_stat->edges[j] = { edge->src, edge->dst, edge->kind, edge->count };
+        }
+        prof_stat->block_hashes.resize(rtn->num_hashes);
+        for (UINT32 j = 0; j < rtn->num_hashes; j++) {
+            const profile_bin_block_hash* block_hash = &hashes[rtn->first_hash + j];
+            prof_stat->block_hashes[j] = { block_hash->offset, block_hash->size, block_hash->hash };
+        }
+        rtn_map.insert({ prof_stat->rtn_name, prof_stat });
+        rtn_offset_map.insert({ prof_stat->image_offset, prof_stat });
+        rtn_heat_set.insert(prof_stat);
+    }
+    munmap(addr, file_size);
+    print_profile_map();
+    return true;
+}
+
+// Reads the NT_GNU_BUILD_ID note: namesz, descsz and type words, then the padded name and the id bytes
+string img_build_id(IMG img)
+{
+    for (SEC sec = IMG_SecHead(img); SEC_Valid(sec); sec = SEC_Next(sec)) {
+        if (SEC_Name(sec) != BUILD_ID_SECTION || SEC_Data(sec) == nullptr) {
+            continue;
+        }
+        const UINT8* note = (const UINT8*)SEC_Data(sec);
+        const UINT8* end = note + SEC_Size(sec);
+        while (note + 12 <= end) {
+            UINT32 name_size = *(const UINT32*)note;
+            UINT32 desc_size = *(const UINT32*)(note + 4);
+            UINT32 type = *(const UINT32*)(note + 8);
+            const UINT8* desc = note + 12 + ((name_size + 3) & ~3);
+            if (desc + desc_size > end) {
+                break;
+            }
+            if (type == NT_GNU_BUILD_ID_TYPE && name_size == 4 && memcmp(note + 12, "GNU", 4) == 0) {
+                string build_id;
+                char byte_hex[3];
+                for (UINT32 i = 0; i < desc_size; i++) {
+                    snprintf(byte_hex, sizeof(byte_hex), "%02x", desc[i]);
+                    build_id += byte_hex;
+                }
+                return build_id;
+            }
+            note = desc + ((desc_size + 3) & ~3);
+        }
+    }
+    return "";
+}
+
+// -prof -prof_follow writes profile.<build-id>.bin for the executables of the child processes, a child run under
+// -opt -follow_execv switches to the profile of its own executable. Returns false if there is none
+static bool load_image_profile(const string& build_id)
+{
+    char file_name[256];
+    snprintf(file_name, sizeof(file_name), PROFILE_BIN_IMAGE_FILE_FORMAT, build_id.c_str());
+    if (access(file_name, R_OK) != 0) {
+        return false;
+    }
+    for (auto it = rtn_map.begin(); it != rtn_map.end(); ++it) {
+        delete it->second;
+    }
+    rtn_map.clear();
+    rtn_heat_set.clear();
+    rtn_offset_map.clear();
+    cout << "loading " << file_name << endl;
+    return construct_profile_bin(file_name);
+}
+
+// The indirect targets of the main executable are offsets tagged with the build-id they were recorded on,
+// only those of this build are rebased on its low address
+static void rebase_indirect_targets(IMG img, const string& build_id)
+{
+    string image_tag = build_id.empty() ? NO_BUILD_ID : build_id;
+    for (auto it = rtn_heat_set.begin(); it != rtn_heat_set.end(); ++it) {
+        for (prof_indirect_target& target : (*it)->indirect_targets) {
+            target.target_addr = (target.target_image == image_tag) ? IMG_LowAddress(img) + target.target_offset : 0;
+        }
+    }
+}
+
+bool check_profile_image(IMG img)
+{
+    string build_id = img_build_id(img);
+    rebase_indirect_targets(img, build_id);
+    if (!opt_csv_knob && !build_id.empty() && build_id != profile_build_id) {
+        load_image_profile(build_id);
+    }
+    if (opt_stale_knob && !opt_csv_knob && (profile_build_id.empty() || build_id != profile_build_id)) {
+        by_image_offset = true;
+        image_base = IMG_LowAddress(img);
+        match_stale_profile(img, image_base);
+        return true;
+    }
+    if (profile_build_id.empty() || build_id.empty()) {
+        if (!opt_csv_knob) {
+            cerr << "Warning: no build-id in " << (build_id.empty() ? IMG_Name(img) : string(PROFILE_BIN_FILE_NAME))
+                 << ", looking the routines up by name." << endl;
+        }
+        return true;
+    }
+    if (build_id != profile_build_id) {
+        cerr << "Error: " << PROFILE_BIN_FILE_NAME << " was recorded on build-id " << profile_build_id << " but "
+             << IMG_Name(img) << " has build-id " << build_id << ", run -prof again or use -opt_stale." << endl;
+        return false;
+    }
+    by_image_offset = true;
+    image_base = IMG_LowAddress(img);
+    return true;
+}
+
+// Finds the routine of the main executable a profile record belongs to
+RTN find_profiled_rtn(IMG img, prof_rtn_stat* prof_stat)
+{
+    if (!by_image_offset) {
+        return RTN_FindByName(img, prof_stat->rtn_name.c_str());
+    }
+    RTN rtn = RTN_FindByAddress(image_base + prof_stat->image_offset);
+    if (rtn == RTN_Invalid() || RTN_Address(rtn) != image_base + prof_stat->image_offset) {
+        return RTN_Invalid();
+    }
+    return rtn;
+}
+
+prof_rtn_stat* find_prof_stat(RTN rtn)
+{
+    if (by_image_offset) {
+        auto it = rtn_offset_map.find(RTN_Address(rtn) - image_base);
+        return (it == rtn_offset_map.end()) ? nullptr : it->second;
+    }
+    auto it = rtn_map.find(RTN_Name(rtn));
+    return (it == rtn_map.end()) ? nullptr : it->second;
+}
+
+// Attaches the block and edge frequencies to the routines of the profile map
+void construct_edge_profile(std::ifstream& edge_file)
+{
+    string line, rtn_name, row_type, field;
+    while (getline(edge_file, line)) {
+        std::stringstream s_stream(line);
+        getline(s_stream, rtn_name, ',');
+        auto it = rtn_map.find(rtn_name);
+        if (it == rtn_map.end()) {
+            continue;
+        }
+        getline(s_stream, row_type, ',');
+        if (row_type == "block") {
+            prof_block block;
+            getline(s_stream, field, ','); // block id, rows come in id order
+            getline(s_stream, field, ',');
+            block.start_offset = std::stoul(field);
+            getline(s_stream, field, ',');
+            block.tail_offset = std::stoul(field);
+            getline(s_stream, field);
+            block.count = std::stoull(field);
+            it->second->blocks.push_back(block);
+        } else if (row_type == "edge") {
+            prof_edge edge;
+            getline(s_stream, field, ',');
+            edge.src = std::stoul(field);
+            getline(s_stream, field, ',');
+            edge.dst = std::stoul(field);
+            getline(s_stream, field, ',');
+            edge.kind = field[0];
+            getline(s_stream, field);
+            edge.count = std::stoull(field);
+            it->second->edges.push_back(edge);
+        }
+    }
+}
+
+// Attaches the hot paths to the routines of the profile map, they are written hottest first
+void construct_path_profile(std::ifstream& path_file)
+{
+    string line, rtn_name, field;
+    while (getline(path_file, line)) {
+        std::stringstream s_stream(line);
+        getline(s_stream, rtn_name, ',');
+        auto it = rtn_map.find(rtn_name);
+        if (it == rtn_map.end()) {
+            continue;
+        }
+        prof_path path;
+        getline(s_stream, field, ','); // rank
+        getline(s_stream, field, ','); // path number
+        getline(s_stream, field, ',');
+        path.count = std::stoull(field);
+        while (getline(s_stream, field, ' ')) {
+            path.block_offsets.push_back(std::stoul(field));
+        }
+        it->second->hot_paths.push_back(path);
+    }
+}
+
+// Attaches the targets of the indirect call and jump sites to the routines of the profile map
+void construct_indirect_profile(std::ifstream& indirect_file)
+{
+    string line, rtn_name, field;
+    while (getline(indirect_file, line)) {
+        std::stringstream s_stream(line);
+        getline(s_stream, rtn_name, ',');
+        auto it = rtn_map.find(rtn_name);
+        if (it == rtn_map.end()) {
+            continue;
+        }
+        prof_indirect_target target;
+        getline(s_stream, field, ',');
+        target.site_offset = std::stoul(field);
+        getline(s_stream, field, ',');
+        target.is_call = (field == "call");
+        getline(s_stream, field, ',');
+        target.site_count = std::stoull(field);
+        getline(s_stream, field, ','); // rank
+        getline(s_stream, field, ',');
+        target.target_offset = std::stoull(field, nullptr, 16);
+        getline(s_stream, target.target_image, ',');
+        target.target_addr = 0; // rebased when the main executable is loaded
+        getline(s_stream, target.target_name, ',');
+        getline(s_stream, field);
+        target.count = std::stoull(field);
+        it->second->indirect_targets.push_back(target);
+        if (target.is_call) {
+            it->second->opt_mode |= OPT_PROMOTE;
+        }
+    }
+}
+
+// Attaches the loops and their trip count histograms to the routines of the profile map
+void construct_loop_profile(std::ifstream& loop_file)
+{
+    string line, rtn_name, field;
+    while (getline(loop_file, line)) {
+        std::stringstream s_stream(line);
+        getline(s_stream, rtn_name, ',');
+        auto it = rtn_map.find(rtn_name);
+        if (it == rtn_map.end()) {
+            continue;
+        }
+        prof_loop loop;
+        getline(s_stream, field, ',');
+        loop.header_offset = std::stoul(field);
+        getline(s_stream, field, ',');
+        loop.latch_offset = std::stoul(field);
+        getline(s_stream, field, ',');
+        loop.invocations = std::stoull(field);
+        getline(s_stream, field, ',');
+        loop.iterations = std::stoull(field);
+        for (UINT32 bucket = 0; bucket < LOOP_HIST_BUCKETS; bucket++) {
+            loop.trip_hist[bucket] = 0;
+            s_stream >> loop.trip_hist[bucket];
+        }
+        it->second->loops.push_back(loop);
+    }
+}
+
+// Attaches the branches with their simulated mispredictions to the routines of the profile map
+void construct_branch_profile(std::ifstream& branch_file)
+{
+    string line, rtn_name, field;
+    while (getline(branch_file, line)) {
+        std::stringstream s_stream(line);
+        getline(s_stream, rtn_name, ',');
+        auto it = rtn_map.find(rtn_name);
+        if (it == rtn_map.end()) {
+            continue;
+        }
+        prof_branch branch;
+        getline(s_stream, field, ',');
+        branch.offset = std::stoul(field);
+        getline(s_stream, field, ',');
+        branch.count = std::stoull(field);
+        getline(s_stream, field, ',');
+        branch.taken = std::stoull(field);
+        getline(s_stream, field);
+        branch.mispredicts = std::stoull(field);
+        it->second->branches.push_back(branch);
+    }
+}
+
+// Attaches the delinquent loads to the routines of the profile map, the translator prefetches them
+void construct_load_profile(std::ifstream& load_file)
+{
+    string line, rtn_name, field;
+    while (getline(load_file, line)) {
+        std::stringstream s_stream(line);
+        getline(s_stream, rtn_name, ',');
+        auto it = rtn_map.find(rtn_name);
+        if (it == rtn_map.end()) {
+            continue;
+        }
+        prof_load load;
+        getline(s_stream, field, ',');
+        load.offset = std::stoul(field);
+        getline(s_stream, field, ',');
+        load.count = std::stoull(field);
+        getline(s_stream, field, ',');
+        load.l1_misses = std::stoull(field);
+        getline(s_stream, field, ',');
+        load.llc_misses = std::stoull(field);
+        getline(s_stream, field, ',');
+        load.stride = std::stoll(field);
+        getline(s_stream, field);
+        load.prefetch_distance = std::stoll(field);
+        it->second->loads.push_back(load);
+        it->second->opt_mode |= OPT_PREFETCH;
+    }
+}
+
+// Attaches the cycles of the timed routines, with -opt_cycle_heat they become the heat the routines are ranked by
+void construct_cycle_profile(std::ifstream& cycle_file)
+{
+    string line, rtn_name, field;
+    while (getline(cycle_file, line)) {
+        std::stringstream s_stream(line);
+        getline(s_stream, rtn_name, ',');
+        auto it = rtn_map.find(rtn_name);
+        if (it == rtn_map.end()) {
+            continue;
+        }
+        getline(s_stream, field, ',');
+        it->second->incl_cycles = std::stoull(field);
+        getline(s_stream, field);
+        it->second->excl_cycles = std::stoull(field);
+    }
+    if (opt_cycle_heat_knob) {
+        use_cycle_heat();
+    }
+}
+
+// Ranks the routines by their exclusive cycles, the heat is the key of rtn_heat_set so the set is rebuilt.
+// Returns false and keeps the instruction counts if no routine was timed
+bool use_cycle_heat()
+{
+    bool timed = false;
+    for (auto it = rtn_map.begin(); it != rtn_map.end() && !timed; ++it) {
+        timed = (it->second->excl_cycles != 0);
+    }
+    if (!timed) {
+        return false;
+    }
+    rtn_heat_set.clear();
+    for (auto it = rtn_map.begin(); it != rtn_map.end(); ++it) {
+        it->second->heat = it->second->excl_cycles;
+        rtn_heat_set.insert(it->second);
+    }
+    return true;
+}
+
 /*
 void get_tc_rtns()
 {
@@ -111,15 +551,70 @@ int main(int argc, char* argv[])
     if (prof_knob) {
         collect_profile_main(argc, argv);
     } else if (opt_knob) {
-        std::ifstream profiling_file(OUTPUT_FILE_NAME);
+        // profile.bin already holds the edges, the mispredictions and the cycles of profile_edges.csv,
+        // profile_branches.csv and profile_cycles.csv
+        bool from_bin = !opt_csv_knob;
+        if (from_bin) {
+            if (!construct_profile_bin(PROFILE_BIN_FILE_NAME)) {
+                cerr << PROFILE_BIN_FILE_NAME << " not found." << endl;
+                cerr << "please run -prof before using -opt, or -opt -opt_csv for a -prof -prof_csv profile." << endl;
+                return -1;
+            }
+        } else {
+            std::ifstream profiling_file(OUTPUT_FILE_NAME);
 
-        if (!profiling_file.is_open()) {
-            cerr << OUTPUT_FILE_NAME << " not found." << endl;
-            cerr << "please run -prof before using -opt." << endl;
-            return -1;
+            if (!profiling_file.is_open()) {
+                cerr << OUTPUT_FILE_NAME << " not found." << endl;
+                cerr << "please run -prof -prof_csv before using -opt -opt_csv." << endl;
+                return -1;
+            }
+            construct_profile_map(profiling_file);
+            profiling_file.close();
+        }
+        // The other profiles are optional, they only exist if -prof ran with the matching -prof_* knob
+        std::ifstream edge_file(EDGE_FILE_NAME);
+        if (!from_bin && edge_file.is_open()) {
+            construct_edge_profile(edge_file);
+            edge_file.close();
+        }
+        std::ifstream path_file(PATH_FILE_NAME);
+        if (path_file.is_open()) {
+            construct_path_profile(path_file);
+            path_file.close();
+        }
+        std::ifstream indirect_file(INDIRECT_FILE_NAME);
+        if (indirect_file.is_open()) {
+            construct_indirect_profile(indirect_file);
+            indirect_file.close();
+        }
+        std::ifstream loop_file(LOOP_FILE_NAME);
+        if (loop_file.is_open()) {
+            construct_loop_profile(loop_file);
+            loop_file.close();
+        }
+        std::ifstream branch_file(BRANCH_FILE_NAME);
+        if (!from_bin && branch_file.is_open()) {
+            construct_branch_profile(branch_file);
+            branch_file.close();
+        }
+        std::ifstream load_file(LOAD_FILE_NAME);
+        if (load_file.is_open()) {
+            construct_load_profile(load_file);
+            load_file.close();
+        }
+        if (from_bin) {
+            if (opt_cycle_heat_knob && !use_cycle_heat()) {
+                cerr << PROFILE_BIN_FILE_NAME << " has no cycles (run -prof -prof_time), ranking the routines by instruction count." << endl;
+            }
+        } else {
+            std::ifstream cycle_file(CYCLES_FILE_NAME);
+            if (cycle_file.is_open()) {
+                construct_cycle_profile(cycle_file);
+                cycle_file.close();
+            } else if (opt_cycle_heat_knob) {
+                cerr << CYCLES_FILE_NAME << " not found, ranking the routines by instruction count." << endl;
+            }
         }
-        construct_profile_map(profiling_file);
-        profiling_file.close();
         // IMG_AddInstrumentFunction(mark_executable_rtns, 0);
         rtn_translation_main(argc, argv);
     } else {
@@ -18,5 +18,16 @@ struct rtn_stat_comp {
 
 extern std::unordered_map<std::string, prof_rtn_stat*> rtn_map;
 extern std::multiset<prof_rtn_stat*, rtn_stat_comp> rtn_heat_set;
+extern std::unordered_map<ADDRINT, prof_rtn_stat*> rtn_offset_map; // image offset -> routine, only from profile.bin
+
+// Checks the build-id of the main executable against the profile, returns false if the profile belongs
+// to another build. Routines are then looked up by image offset, or by name if a build-id is missing
+bool check_profile_image(IMG img);
+RTN find_profiled_rtn(IMG img, prof_rtn_stat* prof_stat);
+prof_rtn_stat* find_prof_stat(RTN rtn); // nullptr if the routine is not in the profile
+
+// stale_match.cpp
+extern KNOB<BOOL> opt_stale_knob;
+VOID match_stale_profile(IMG img, ADDRINT image_base);
 
 #endif
\ No newline at end of file
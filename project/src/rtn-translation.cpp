@@ -76,6 +76,9 @@ KNOB<BOOL> KnobDumpTranslatedCode(KNOB_MODE_WRITEONCE, "pintool",
 KNOB<BOOL> KnobDoNotCommitTranslatedCode(KNOB_MODE_WRITEONCE, "pintool",
     "no_tc_commit", "0", "Do not commit translated code");
 
+KNOB<BOOL> KnobDumpLayout(KNOB_MODE_WRITEONCE, "pintool",
+    "dump_layout", "0", "Dump the orig to new address of every translated instruction to tc_layout.csv");
+
 /* ===================================================================== */
 /* Global Variables */
 /* ===================================================================== */
@@ -277,6 +280,26 @@ void dump_tc()
 /* Translation routines                                         */
 /* ============================================================= */
 
+/*******************/
+/* dump_tc_layout() */
+/*******************/
+// Each row is orig_ins_offset,new_ins_offset,size - the -prof icache simulator replays the fetches on this layout.
+// The original address is an offset from the image's low address and the new one from the tc, so the layout
+// still matches a PIE loaded at another address
+void dump_tc_layout(IMG img)
+{
+    FILE* file_ptr = fopen(LAYOUT_FILE_NAME, "w");
+    if (file_ptr == NULL) {
+        cerr << "Error: opening a file" << endl;
+        return;
+    }
+    for (int i = 0; i < num_of_instr_map_entries; i++) {
+        fprintf(file_ptr, "0x%lx,0x%lx,%u\n", instr_map[i].orig_ins_addr - IMG_LowAddress(img),
+            instr_map[i].new_ins_addr - (ADDRINT)tc, instr_map[i].size);
+    }
+    fclose(file_ptr);
+}
+
 /*************************/
 /* add_new_instr_entry() */
 /*************************/
@@ -716,22 +739,19 @@ int find_candidate_rtns_for_translation(IMG img)
     //         continue;
     //     for (RTN rtn = SEC_RtnHead(sec); RTN_Valid(rtn); rtn = RTN_Next(rtn)) {
     for (auto it = rtn_heat_set.begin(); it != rtn_heat_set.end(); ++it) {
-        RTN rtn = RTN_FindByName(img, (*it)->rtn_name.c_str());
+        RTN rtn = find_profiled_rtn(img, *it);
 
         if (rtn == RTN_Invalid()) {
             cerr << "Warning: invalid routine " << (*it)->rtn_name << endl;
             continue;
         }
-        if (rtn_map.find(RTN_Name(rtn)) == rtn_map.end()) {
-            continue;
-        }
 
         translated_rtn[translated_rtn_num].rtn_addr = RTN_Address(rtn);
         translated_rtn[translated_rtn_num].rtn_size = RTN_Size(rtn);
         translated_rtn[translated_rtn_num].instr_map_entry = num_of_instr_map_entries;
         translated_rtn[translated_rtn_num].isSafeForReplacedProbe = true;
 
-        optimize_translated_routine(rtn, rtn_map[RTN_Name(rtn)]);
+        optimize_translated_routine(rtn, *it);
 
     } // end for RTN..
     //} // end for SEC...
@@ -828,7 +848,7 @@ int allocate_and_init_memory(IMG img)
 
             if (rtn == RTN_Invalid())
                 continue;
-            if (rtn_map.find(RTN_Name(rtn)) == rtn_map.end()) {
+            if (find_prof_stat(rtn) == nullptr) {
                 continue;
             }
             max_ins_count += RTN_NumIns(rtn);
@@ -889,6 +909,10 @@ VOID ImageLoad(IMG img, VOID* v)
 
     int rc = 0;
 
+    // The profile must come from this build of the executable
+    if (!check_profile_image(img))
+        return;
+
     // step 1: Check size of executable sections and allocate required memory:
     rc = allocate_and_init_memory(img);
     if (rc < 0)
@@ -924,6 +948,10 @@ VOID ImageLoad(IMG img, VOID* v)
 
     cout << "after write all new instructions to memory tc" << endl;
 
+    if (KnobDumpLayout) {
+        dump_tc_layout(img);
+    }
+
     if (KnobDumpTranslatedCode) {
         cerr << "Translation Cache dump:" << endl;
         dump_tc(); // dump the entire tc
@@ -0,0 +1,150 @@
+#include "pin.H"
+#include "prof_rtn_stat.h"
+#include "profile.h"
+#include <cstdio>
+#include <iostream>
+#include <signal.h>
+#include <stdlib.h>
+
+using std::cerr;
+using std::endl;
+
+#define SNAPSHOT_POLL_MS 100
+#define SNAPSHOT_DELTA_FILE_FORMAT "profile_stat.delta.%u.csv"
+#define SNAPSHOT_DELTA_BIN_FILE_FORMAT "profile.delta.%u.bin"
+
+extern KNOB<BOOL> prof_per_thread_knob;
+extern KNOB<BOOL> prof_csv_knob;
+
+KNOB<UINT32> prof_snapshot_secs_knob(KNOB_MODE_WRITEONCE, "pintool", "prof_snapshot_secs", "0", "write a profile snapshot every N seconds (0 = off)");
+KNOB<UINT64> prof_snapshot_ins_knob(KNOB_MODE_WRITEONCE, "pintool", "prof_snapshot_ins", "0", "write a profile snapshot every N main executable instructions, counted by the instruction clock of the main executable basic blocks (0 = off)");
+KNOB<BOOL> prof_snapshot_signal_knob(KNOB_MODE_WRITEONCE, "pintool", "prof_snapshot_signal", "0", "write a profile snapshot when the process gets SIGUSR2");
+KNOB<BOOL> prof_snapshot_delta_knob(KNOB_MODE_WRITEONCE, "pintool", "prof_snapshot_delta", "0", "write every snapshot to its own numbered file with the instructions since the previous snapshot as the heat");
+
+static PIN_THREAD_UID snapshot_thread_uid;
+static volatile bool snapshot_thread_exit = false;
+static bool snapshot_thread_running = false;
+static volatile bool snapshot_requested = false;
+static UINT32 snapshot_seq = 0;
+static PIN_LOCK snapshot_lock; // the snapshot thread and the instruction clock both take snapshots
+static volatile INT64 snapshot_countdown = INT64_MAX; // instructions left until the next -prof_snapshot_ins snapshot
+static volatile bool snapshots_stopped = false;
+
+// The snapshot is written to a temporary file and renamed over the previous one,
+// so a reader never sees a half written profile even if the process is killed
+static VOID take_snapshot()
+{
+    char file_name[64];
+    char tmp_name[64 + 4];
+    if (prof_snapshot_delta_knob) {
+        snprintf(file_name, sizeof(file_name), prof_csv_knob ? SNAPSHOT_DELTA_FILE_FORMAT : SNAPSHOT_DELTA_BIN_FILE_FORMAT, snapshot_seq);
+    } else {
+        snprintf(file_name, sizeof(file_name), "%s", profile_file_name());
+    }
+    snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", file_name);
+    PIN_GetLock(&snapshot_lock, 0);
+    // The client lock keeps the instrumentation callbacks from adding routines while the maps are read
+    PIN_LockClient();
+    if (prof_per_thread_knob) {
+        merge_thread_slabs();
+    }
+    bool written = write_profile(tmp_name, prof_snapshot_delta_knob);
+    PIN_UnlockClient();
+    if (written && rename(tmp_name, file_name) != 0) {
+        cerr << "Error: renaming the snapshot " << tmp_name << endl;
+        written = false;
+    }
+    if (written) {
+        snapshot_seq++;
+    }
+    PIN_ReleaseLock(&snapshot_lock);
+}
+
+// Takes the -prof_snapshot_secs and -prof_snapshot_signal snapshots
+static VOID snapshot_thread(VOID* arg)
+{
+    UINT64 waited_ms = 0;
+    while (!snapshot_thread_exit) {
+        PIN_Sleep(SNAPSHOT_POLL_MS);
+        bool due = snapshot_requested;
+        waited_ms += SNAPSHOT_POLL_MS;
+        if (prof_snapshot_secs_knob && waited_ms >= prof_snapshot_secs_knob.Value() * 1000ULL) {
+            due = true;
+        }
+        if (due) {
+            snapshot_requested = false;
+            waited_ms = 0;
+            take_snapshot();
+        }
+    }
+}
+
+// Advances the snapshot clock and tells when the next -prof_snapshot_ins snapshot is due
+static ADDRINT PIN_FAST_ANALYSIS_CALL snapshot_tick(UINT32 c)
+{
+    return ((snapshot_countdown -= c) <= 0);
+}
+
+// The application thread that crossed the interval writes the snapshot, so it is taken within one basic block
+static VOID snapshot_ins_event()
+{
+    // Another thread may be writing it already
+    if (snapshot_countdown > 0 || snapshots_stopped) {
+        return;
+    }
+    snapshot_countdown = prof_snapshot_ins_knob.Value();
+    take_snapshot();
+}
+
+VOID insert_snapshot_tick(BBL bbl)
+{
+    BBL_InsertIfCall(bbl, IPOINT_BEFORE, (AFUNPTR)snapshot_tick, IARG_FAST_ANALYSIS_CALL, IARG_UINT32, BBL_NumIns(bbl), IARG_END);
+    BBL_InsertThenCall(bbl, IPOINT_BEFORE, (AFUNPTR)snapshot_ins_event, IARG_END);
+}
+
+// SIGUSR2 only asks the snapshot thread for a snapshot, the application does not see it
+static BOOL snapshot_signal(THREADID tid, INT32 sig, CONTEXT* ctxt, BOOL has_handler, const EXCEPTION_INFO* info, VOID* v)
+{
+    snapshot_requested = true;
+    return FALSE;
+}
+
+// Stops the snapshot thread before fini writes the final profile
+static VOID snapshot_prepare_fini(VOID* v)
+{
+    if (!snapshot_thread_running) {
+        return;
+    }
+    snapshot_thread_exit = true;
+    PIN_WaitForThreadTermination(snapshot_thread_uid, PIN_INFINITE_TIMEOUT, nullptr);
+}
+
+bool init_snapshots()
+{
+    PIN_InitLock(&snapshot_lock);
+    if (prof_snapshot_ins_knob) {
+        snapshot_countdown = prof_snapshot_ins_knob.Value();
+    }
+    if (!prof_snapshot_secs_knob && !prof_snapshot_signal_knob) {
+        return true;
+    }
+    if (prof_snapshot_signal_knob) {
+        PIN_InterceptSignal(SIGUSR2, snapshot_signal, 0);
+    }
+    if (PIN_SpawnInternalThread(snapshot_thread, nullptr, 0, &snapshot_thread_uid) == INVALID_THREADID) {
+        cerr << "Error: cannot start the profile snapshot thread" << endl;
+        return false;
+    }
+    snapshot_thread_running = true;
+    PIN_AddPrepareForFiniFunction(snapshot_prepare_fini, 0);
+    return true;
+}
+
+// Internal threads do not survive fork, a forked child takes no snapshots
+VOID stop_snapshots_after_fork()
+{
+    snapshots_stopped = true;
+    snapshot_countdown = INT64_MAX;
+    snapshot_thread_running = false;
+    snapshot_thread_exit = true;
+}
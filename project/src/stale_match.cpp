@@ -0,0 +1,286 @@
+#include "pin.H"
+#include "prof_rtn_stat.h"
+#include "project.h"
+#include <algorithm>
+#include <iostream>
+#include <unordered_set>
+
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::string;
+using std::unordered_map;
+using std::unordered_set;
+using std::vector;
+
+#define FNV_OFFSET_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+#define MAX_ALIGN_CELLS (1 << 22) // routines with more block pairs than this are not aligned
+
+KNOB<BOOL> opt_stale_knob(KNOB_MODE_WRITEONCE, "pintool", "opt_stale", "0", "match a profile.bin of another build to the routines of this build by their block fingerprints");
+KNOB<UINT32> opt_stale_confidence_knob(KNOB_MODE_WRITEONCE, "pintool", "opt_stale_confidence", "60", "minimal percentage of matching blocks for a stale routine to be optimized");
+
+static UINT32 fnv_hash(UINT32 hash, UINT32 value)
+{
+    for (UINT32 i = 0; i < 4; i++) {
+        hash = (hash ^ ((value >> (i * 8)) & 0xff)) * FNV_PRIME;
+    }
+    return hash;
+}
+
+// Splits the routine into basic blocks at the direct branch targets and after every control flow instruction,
+// and hashes the opcodes of each block. Operands are left out so relinking and register changes do not matter
+VOID rtn_fingerprint(RTN rtn, vector<prof_block_hash>& block_hashes)
+{
+    ADDRINT rtn_addr = RTN_Address(rtn);
+    ADDRINT rtn_end = rtn_addr + RTN_Size(rtn);
+    vector<ADDRINT> leaders;
+    for (INS ins = RTN_InsHead(rtn); INS_Valid(ins); ins = INS_Next(ins)) {
+        if (INS_IsDirectControlFlow(ins) && !INS_IsCall(ins)) {
+            ADDRINT target = INS_DirectControlFlowTargetAddress(ins);
+            if (target >= rtn_addr && target < rtn_end) {
+                leaders.push_back(target);
+            }
+        }
+    }
+    std::sort(leaders.begin(), leaders.end());
+    block_hashes.clear();
+    bool block_ended = true;
+    for (INS ins = RTN_InsHead(rtn); INS_Valid(ins); ins = INS_Next(ins)) {
+        ADDRINT ins_addr = INS_Address(ins);
+        if (block_ended || std::binary_search(leaders.begin(), leaders.end(), ins_addr)) {
+            prof_block_hash block = { (UINT32)(ins_addr - rtn_addr), 0, FNV_OFFSET_BASIS };
+            block_hashes.push_back(block);
+        }
+        prof_block_hash& block = block_hashes.back();
+        block.size += INS_Size(ins);
+        block.hash = fnv_hash(block.hash, INS_Opcode(ins));
+        block_ended = INS_IsControlFlow(ins);
+    }
+}
+
+// Hash of the whole routine, to find a renamed routine
+static UINT32 rtn_hash(const vector<prof_block_hash>& block_hashes)
+{
+    UINT32 hash = FNV_OFFSET_BASIS;
+    for (auto it = block_hashes.begin(); it != block_hashes.end(); ++it) {
+        hash = fnv_hash(hash, it->hash);
+    }
+    return hash;
+}
+
+// Maps the block offsets of the old build to the matching blocks of the new one
+struct block_alignment {
+    vector<prof_block_hash> old_blocks; // sorted by offset
+    vector<INT32> new_block; // old block index -> new block index or -1
+    vector<prof_block_hash> new_blocks;
+
+    // An offset inside a matched block keeps its distance from the block start when the block kept its size
+    bool map_offset(UINT32 old_offset, UINT32* new_offset) const
+    {
+        auto it = std::upper_bound(old_blocks.begin(), old_blocks.end(), old_offset,
+            [](UINT32 offset, const prof_block_hash& block) { return offset < block.offset; });
+        if (it == old_blocks.begin()) {
+            return false;
+        }
+        --it;
+        INT32 match = new_block[it - old_blocks.begin()];
+        UINT32 delta = old_offset - it->offset;
+        if (match < 0 || delta >= it->size || (delta != 0 && new_blocks[match].size != it->size)) {
+            return false;
+        }
+        *new_offset = new_blocks[match].offset + delta;
+        return true;
+    }
+};
+
+// Longest common subsequence of the block hashes, returns the number of matched blocks
+static UINT32 align_blocks(block_alignment& alignment)
+{
+    size_t n = alignment.old_blocks.size();
+    size_t m = alignment.new_blocks.size();
+    alignment.new_block.assign(n, -1);
+    if (n == 0 || m == 0 || n * m > MAX_ALIGN_CELLS) {
+        return 0;
+    }
+    vector<UINT32> lcs((n + 1) * (m + 1), 0);
+    for (size_t i = n; i-- > 0;) {
+        for (size_t j = m; j-- > 0;) {
+            if (alignment.old_blocks[i].hash == alignment.new_blocks[j].hash) {
+                lcs[i * (m + 1) + j] = lcs[(i + 1) * (m + 1) + j + 1] + 1;
+            } else {
+                lcs[i * (m + 1) + j] = std::max(lcs[(i + 1) * (m + 1) + j], lcs[i * (m + 1) + j + 1]);
+            }
+        }
+    }
+    size_t i = 0, j = 0;
+    while (i < n && j < m) {
+        if (alignment.old_blocks[i].hash == alignment.new_blocks[j].hash) {
+            alignment.new_block[i++] = j++;
+        } else if (lcs[(i + 1) * (m + 1) + j] >= lcs[i * (m + 1) + j + 1]) {
+            i++;
+        } else {
+            j++;
+        }
+    }
+    return lcs[0];
+}
+
+// Moves every offset of the routine profile to the new build, the entries that cannot be mapped are dropped
+static VOID remap_prof_stat(prof_rtn_stat* prof_stat, const block_alignment& alignment)
+{
+    UINT32 offset;
+    if ((prof_stat->opt_mode & OPT_REORDER) && alignment.map_offset(prof_stat->rtn_branch_offset, &offset)) {
+        prof_stat->rtn_branch_offset = offset;
+    } else {
+        prof_stat->opt_mode &= ~OPT_REORDER;
+    }
+    if ((prof_stat->opt_mode & OPT_INLINE) && alignment.map_offset(prof_stat->rtn_inline_offset, &offset)) {
+        prof_stat->rtn_inline_offset = offset;
+    } else {
+        prof_stat->opt_mode &= ~OPT_INLINE;
+    }
+    // The target offsets are from the old build
+    prof_stat->opt_mode &= ~OPT_PROMOTE;
+    prof_stat->indirect_targets.clear();
+
+    vector<prof_branch> branches;
+    for (auto it = prof_stat->branches.begin(); it != prof_stat->branches.end(); ++it) {
+        if (alignment.map_offset(it->offset, &offset)) {
+            branches.push_back(*it);
+            branches.back().offset = offset;
+        }
+    }
+    prof_stat->branches.swap(branches);
+    vector<prof_call> calls;
+    for (auto it = prof_stat->calls.begin(); it != prof_stat->calls.end(); ++it) {
+        if (alignment.map_offset(it->offset, &offset)) {
+            calls.push_back(*it);
+            calls.back().offset = offset;
+        }
+    }
+    prof_stat->calls.swap(calls);
+    vector<prof_load> loads;
+    for (auto it = prof_stat->loads.begin(); it != prof_stat->loads.end(); ++it) {
+        if (alignment.map_offset(it->offset, &offset)) {
+            loads.push_back(*it);
+            loads.back().offset = offset;
+        }
+    }
+    prof_stat->loads.swap(loads);
+    if (prof_stat->loads.empty()) {
+        prof_stat->opt_mode &= ~OPT_PREFETCH;
+    }
+    vector<prof_loop> loops;
+    UINT32 latch;
+    for (auto it = prof_stat->loops.begin(); it != prof_stat->loops.end(); ++it) {
+        if (alignment.map_offset(it->header_offset, &offset) && alignment.map_offset(it->latch_offset, &latch)) {
+            loops.push_back(*it);
+            loops.back().header_offset = offset;
+            loops.back().latch_offset = latch;
+        }
+    }
+    prof_stat->loops.swap(loops);
+    vector<prof_path> paths;
+    for (auto it = prof_stat->hot_paths.begin(); it != prof_stat->hot_paths.end(); ++it) {
+        prof_path path = { it->count, {} };
+        for (auto block = it->block_offsets.begin(); block != it->block_offsets.end() && alignment.map_offset(*block, &offset); ++block) {
+            path.block_offsets.push_back(offset);
+        }
+        if (path.block_offsets.size() == it->block_offsets.size()) {
+            paths.push_back(path);
+        }
+    }
+    prof_stat->hot_paths.swap(paths);
+    // Blocks are indexed by the edges, a block that cannot be mapped keeps its place with no count
+    UINT32 tail;
+    for (auto it = prof_stat->blocks.begin(); it != prof_stat->blocks.end(); ++it) {
+        if (alignment.map_offset(it->start_offset, &offset) && alignment.map_offset(it->tail_offset, &tail)) {
+            it->start_offset = offset;
+            it->tail_offset = tail;
+        } else {
+            it->count = 0;
+        }
+    }
+}
+
+// Carries a profile of another build over to the routines of img: a routine is paired with the routine of the
+// same name, or with a routine of identical fingerprint if it was renamed, and its blocks are aligned by hash.
+// The share of aligned blocks is the confidence, the heat is scaled by it and routines below
+// -opt_stale_confidence are not optimized. Every routine of img takes at most one profile record, name pairs go
+// first and fingerprints shared by several routines (wrappers, identical code folding) pair nothing.
+// Returns the image offsets of the matched routines in rtn_offset_map
+VOID match_stale_profile(IMG img, ADDRINT image_base)
+{
+    unordered_map<UINT32, RTN> rtns_by_hash;
+    unordered_set<UINT32> ambiguous_hashes;
+    unordered_map<ADDRINT, vector<prof_block_hash>> new_fingerprints;
+    for (SEC sec = IMG_SecHead(img); SEC_Valid(sec); sec = SEC_Next(sec)) {
+        if (!SEC_IsExecutable(sec)) {
+            continue;
+        }
+        for (RTN rtn = SEC_RtnHead(sec); RTN_Valid(rtn); rtn = RTN_Next(rtn)) {
+            vector<prof_block_hash>& fingerprint = new_fingerprints[RTN_Address(rtn)];
+            RTN_Open(rtn);
+            rtn_fingerprint(rtn, fingerprint);
+            RTN_Close(rtn);
+            if (!rtns_by_hash.insert({ rtn_hash(fingerprint), rtn }).second) {
+                ambiguous_hashes.insert(rtn_hash(fingerprint));
+            }
+        }
+    }
+
+    vector<prof_rtn_stat*> records(rtn_heat_set.begin(), rtn_heat_set.end()); // hottest first
+    vector<RTN> paired(records.size(), RTN_Invalid());
+    unordered_set<ADDRINT> claimed;
+    for (size_t i = 0; i < records.size(); i++) {
+        RTN rtn = RTN_FindByName(img, records[i]->rtn_name.c_str());
+        if (rtn != RTN_Invalid() && claimed.insert(RTN_Address(rtn)).second) {
+            paired[i] = rtn;
+        }
+    }
+    for (size_t i = 0; i < records.size(); i++) {
+        if (paired[i] != RTN_Invalid() || records[i]->block_hashes.empty()) {
+            continue;
+        }
+        UINT32 hash = rtn_hash(records[i]->block_hashes);
+        auto by_hash = rtns_by_hash.find(hash);
+        if (by_hash != rtns_by_hash.end() && ambiguous_hashes.count(hash) == 0
+            && claimed.insert(RTN_Address(by_hash->second)).second) {
+            paired[i] = by_hash->second;
+        }
+    }
+
+    UINT32 matched = 0;
+    rtn_offset_map.clear();
+    vector<prof_rtn_stat*> kept;
+    for (size_t i = 0; i < records.size(); i++) {
+        prof_rtn_stat* prof_stat = records[i];
+        RTN rtn = paired[i];
+        if (rtn == RTN_Invalid() || new_fingerprints.find(RTN_Address(rtn)) == new_fingerprints.end()) {
+            continue;
+        }
+        block_alignment alignment;
+        alignment.old_blocks = prof_stat->block_hashes;
+        alignment.new_blocks = new_fingerprints[RTN_Address(rtn)];
+        UINT32 aligned = align_blocks(alignment);
+        size_t total = std::max(alignment.old_blocks.size(), alignment.new_blocks.size());
+        prof_stat->stale_confidence = total ? (UINT32)(aligned * 100 / total) : 0;
+        cout << "stale match: " << prof_stat->rtn_name << " -> " << RTN_Name(rtn) << " confidence: "
+             << prof_stat->stale_confidence << "%" << endl;
+        if (prof_stat->stale_confidence < opt_stale_confidence_knob.Value()) {
+            continue;
+        }
+        remap_prof_stat(prof_stat, alignment);
+        prof_stat->heat = prof_stat->heat * prof_stat->stale_confidence / 100;
+        prof_stat->image_offset = RTN_Address(rtn) - image_base;
+        prof_stat->rtn_addr = RTN_Address(rtn);
+        rtn_offset_map[prof_stat->image_offset] = prof_stat;
+        kept.push_back(prof_stat);
+        matched++;
+    }
+    cout << "stale profile: matched " << matched << " of " << records.size() << " routines" << endl;
+    // Only the matched routines are translated, the heat is the key of rtn_heat_set so the set is rebuilt
+    rtn_heat_set.clear();
+    rtn_heat_set.insert(kept.begin(), kept.end());
+}
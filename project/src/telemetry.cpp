@@ -0,0 +1,168 @@
+#include "pin.H"
+#include "profile.h"
+#include "telemetry.h"
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/mman.h>
+#include <unistd.h>
+
+using std::cerr;
+using std::endl;
+using std::string;
+using std::vector;
+
+#define TELEMETRY_SHM_DIR "/dev/shm" // where shm_open keeps its objects on Linux
+
+extern KNOB<BOOL> prof_per_thread_knob;
+
+KNOB<BOOL> prof_telemetry_knob(KNOB_MODE_WRITEONCE, "pintool", "prof_telemetry", "0", "publish the live routine, branch and call counters in a shared memory segment for telemetry_reader");
+KNOB<string> prof_telemetry_name_knob(KNOB_MODE_WRITEONCE, "pintool", "prof_telemetry_name", TELEMETRY_DEFAULT_NAME, "name of the telemetry shared memory segment");
+KNOB<UINT32> prof_telemetry_ms_knob(KNOB_MODE_WRITEONCE, "pintool", "prof_telemetry_ms", "100", "milliseconds between two telemetry updates");
+
+static telemetry_segment* segment = nullptr;
+static PIN_THREAD_UID telemetry_thread_uid;
+static volatile bool telemetry_thread_exit = false;
+static bool telemetry_thread_running = false;
+
+// Copies the counters into the segment, the caller holds the client lock
+static VOID publish_telemetry()
+{
+    vector<rtn_stat*> stats;
+    get_rtn_stats(stats);
+    __atomic_store_n(&segment->seq, segment->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    UINT32 num_rtns = 0;
+    UINT32 num_branches = 0;
+    UINT32 num_calls = 0;
+    UINT32 dropped = 0;
+    for (rtn_stat* stat : stats) {
+        if (num_rtns == TELEMETRY_MAX_RTNS) {
+            dropped++;
+            continue;
+        }
+        telemetry_rtn* rtn = &segment->rtns[num_rtns];
+        strncpy(rtn->name, stat->rtn_name.c_str(), TELEMETRY_NAME_LEN - 1);
+        rtn->name[TELEMETRY_NAME_LEN - 1] = '\0';
+        rtn->addr = stat->rtn_addr;
+        rtn->rtn_count = stat->rtn_count;
+        rtn->ins_count = stat->ins_count;
+        for (branch_stat* branch : stat->branches) {
+            if (num_branches == TELEMETRY_MAX_BRANCHES) {
+                dropped++;
+                continue;
+            }
+            telemetry_branch* out = &segment->branches[num_branches++];
+            out->rtn_index = num_rtns;
+            out->offset = branch->branch_addr - stat->rtn_addr;
+            out->count = branch->branch_count;
+            out->taken = branch->branch_taken;
+        }
+        for (call_stat* call : stat->rtn_calls) {
+            if (num_calls == TELEMETRY_MAX_CALLS) {
+                dropped++;
+                continue;
+            }
+            telemetry_call* out = &segment->calls[num_calls++];
+            out->rtn_index = num_rtns;
+            out->offset = call->inst_call_addr - stat->rtn_addr;
+            out->callee_addr = call->callee_addr;
+            out->count = call->call_count;
+        }
+        num_rtns++;
+    }
+    segment->num_rtns = num_rtns;
+    segment->num_branches = num_branches;
+    segment->num_calls = num_calls;
+    segment->dropped = dropped;
+    segment->publish_count++;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&segment->seq, segment->seq + 1, __ATOMIC_RELAXED);
+}
+
+static VOID locked_publish_telemetry()
+{
+    // The client lock keeps the instrumentation callbacks from adding routines while the maps are read
+    PIN_LockClient();
+    if (prof_per_thread_knob) {
+        merge_thread_slabs();
+    }
+    publish_telemetry();
+    PIN_UnlockClient();
+}
+
+static VOID telemetry_thread(VOID* arg)
+{
+    while (!telemetry_thread_exit) {
+        PIN_Sleep(prof_telemetry_ms_knob.Value());
+        locked_publish_telemetry();
+    }
+}
+
+// Stops the telemetry thread and publishes the final counters, the segment is left in place
+// so the last values can still be read after the process exits
+static VOID telemetry_prepare_fini(VOID* v)
+{
+    if (!telemetry_thread_running) {
+        return;
+    }
+    telemetry_thread_exit = true;
+    PIN_WaitForThreadTermination(telemetry_thread_uid, PIN_INFINITE_TIMEOUT, nullptr);
+    locked_publish_telemetry();
+}
+
+bool init_telemetry()
+{
+    if (!prof_telemetry_knob) {
+        return true;
+    }
+    const string& name = prof_telemetry_name_knob.Value();
+    if (name.empty() || name[0] != '/' || name.find('/', 1) != string::npos) {
+        cerr << "Error: the telemetry segment name must look like /name" << endl;
+        return false;
+    }
+    // Same object as shm_open(name), opened through the file system to stay within the Pin CRT
+    string path = string(TELEMETRY_SHM_DIR) + name;
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        cerr << "Error: cannot create the telemetry segment " << path << endl;
+        return false;
+    }
+    if (ftruncate(fd, sizeof(telemetry_segment)) != 0) {
+        cerr << "Error: cannot size the telemetry segment " << path << endl;
+        close(fd);
+        return false;
+    }
+    void* addr = mmap(nullptr, sizeof(telemetry_segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        cerr << "Error: cannot map the telemetry segment " << path << endl;
+        return false;
+    }
+    // The file starts zeroed, the magic is written last so a reader never accepts a half initialized header
+    segment = (telemetry_segment*)addr;
+    segment->version = TELEMETRY_VERSION;
+    segment->max_rtns = TELEMETRY_MAX_RTNS;
+    segment->max_branches = TELEMETRY_MAX_BRANCHES;
+    segment->max_calls = TELEMETRY_MAX_CALLS;
+    segment->pid = PIN_GetPid();
+    __atomic_store_n(&segment->magic, TELEMETRY_MAGIC, __ATOMIC_RELEASE);
+    if (PIN_SpawnInternalThread(telemetry_thread, nullptr, 0, &telemetry_thread_uid) == INVALID_THREADID) {
+        cerr << "Error: cannot start the telemetry thread" << endl;
+        return false;
+    }
+    telemetry_thread_running = true;
+    PIN_AddPrepareForFiniFunction(telemetry_prepare_fini, 0);
+    return true;
+}
+
+// A forked child has no telemetry thread and must not write its counters over the parent's segment
+VOID stop_telemetry_after_fork()
+{
+    telemetry_thread_running = false;
+    telemetry_thread_exit = true;
+    if (segment != nullptr) {
+        munmap(segment, sizeof(telemetry_segment));
+        segment = nullptr;
+    }
+}
@@ -0,0 +1,60 @@
+#ifndef TELEMETRY_HEADER
+#define TELEMETRY_HEADER
+#include <stdint.h>
+
+/* ============================================================= */
+/* Layout of the live telemetry shared memory segment            */
+/* ============================================================= */
+
+// Shared by the pintool and telemetry_reader, so it only uses fixed size types.
+// Bump TELEMETRY_VERSION whenever a field or a limit changes
+#define TELEMETRY_MAGIC 0x4d4c5444 // "DTLM"
+#define TELEMETRY_VERSION 1
+#define TELEMETRY_DEFAULT_NAME "/dbt_telemetry"
+#define TELEMETRY_NAME_LEN 64
+#define TELEMETRY_MAX_RTNS 4096
+#define TELEMETRY_MAX_BRANCHES 16384
+#define TELEMETRY_MAX_CALLS 16384
+
+struct telemetry_rtn {
+    char name[TELEMETRY_NAME_LEN]; // truncated routine name, always null terminated
+    uint64_t addr;
+    uint64_t rtn_count;
+    uint64_t ins_count;
+};
+
+struct telemetry_branch {
+    uint32_t rtn_index; // index in rtns
+    uint32_t offset; // branch offset from the routine address
+    uint64_t count;
+    uint64_t taken;
+};
+
+struct telemetry_call {
+    uint32_t rtn_index; // index of the caller in rtns
+    uint32_t offset; // call offset from the routine address
+    uint64_t callee_addr;
+    uint64_t count;
+};
+
+// The writer makes seq odd before it updates the tables and even again after, a reader copies
+// the segment and retries while seq is odd or changed during the copy
+struct telemetry_segment {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t max_rtns;
+    uint32_t max_branches;
+    uint32_t max_calls;
+    uint32_t pid;
+    volatile uint64_t seq;
+    uint64_t publish_count;
+    uint32_t num_rtns;
+    uint32_t num_branches;
+    uint32_t num_calls;
+    uint32_t dropped; // routines, branches and calls that did not fit
+    telemetry_rtn rtns[TELEMETRY_MAX_RTNS];
+    telemetry_branch branches[TELEMETRY_MAX_BRANCHES];
+    telemetry_call calls[TELEMETRY_MAX_CALLS];
+};
+
+#endif
@@ -0,0 +1,102 @@
+#include "pin.H"
+#include "prof_rtn_stat.h"
+#include "profile.h"
+#include <cstdio>
+#include <iostream>
+#include <stdlib.h>
+#include <vector>
+
+using std::cerr;
+using std::endl;
+
+using std::vector;
+
+KNOB<BOOL> prof_time_knob(KNOB_MODE_WRITEONCE, "pintool", "prof_time", "0", "time the main executable routines with the TSC and save their inclusive and exclusive cycles to the file profile_cycles.csv");
+
+static vector<rtn_stat*> timed_rtns;
+
+static inline UINT64 read_tsc()
+{
+    UINT32 lo, hi;
+    __asm__ volatile("rdtsc"
+                     : "=a"(lo), "=d"(hi));
+    return ((UINT64)hi << 32) | lo;
+}
+
+// Closes the top frame at now and charges its inclusive cycles to the caller's children
+static inline VOID pop_time_frame(thread_state* state, UINT64 now)
+{
+    time_frame frame = state->time_stack.back();
+    state->time_stack.pop_back();
+    UINT64 inclusive = now - frame.start;
+    frame.stat->incl_cycles += inclusive;
+    frame.stat->excl_cycles += inclusive - frame.child_cycles;
+    if (!state->time_stack.empty()) {
+        state->time_stack.back().child_cycles += inclusive;
+    }
+}
+
+// Frames at or below the stack pointer of a routine entry or return are over, their routine returned
+// or left by a tail call or a longjmp
+static inline VOID pop_ended_frames(thread_state* state, ADDRINT sp, UINT64 now)
+{
+    while (!state->time_stack.empty() && state->time_stack.back().sp <= sp) {
+        pop_time_frame(state, now);
+    }
+}
+
+VOID time_enter(thread_state* state, rtn_stat* stat, ADDRINT sp)
+{
+    UINT64 now = read_tsc();
+    pop_ended_frames(state, sp, now);
+    state->time_stack.push_back(time_frame(stat, sp, now));
+}
+
+VOID time_return(thread_state* state, ADDRINT sp)
+{
+    pop_ended_frames(state, sp, read_tsc());
+}
+
+VOID instrument_rtn_time(RTN rtn, rtn_stat* stat)
+{
+    // Pin instruments a routine again when its code is regenerated (tiered profiling)
+    if (!stat->timed) {
+        stat->timed = true;
+        timed_rtns.push_back(stat);
+    }
+    RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR)time_enter, IARG_REG_VALUE, thread_state_reg, IARG_PTR, stat,
+        IARG_REG_VALUE, REG_STACK_PTR, IARG_END);
+    for (INS ins = RTN_InsHead(rtn); INS_Valid(ins); ins = INS_Next(ins)) {
+        if (INS_IsRet(ins)) {
+            INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)time_return, IARG_REG_VALUE, thread_state_reg,
+                IARG_REG_VALUE, REG_STACK_PTR, IARG_END);
+        }
+    }
+}
+
+// The routines that are still running when the thread ends (main calling exit) are closed here
+VOID time_thread_fini(thread_state* state)
+{
+    UINT64 now = read_tsc();
+    while (!state->time_stack.empty()) {
+        pop_time_frame(state, now);
+    }
+}
+
+// One row per timed routine: routine name,inclusive cycles,exclusive cycles.
+// A recursive routine adds the inclusive cycles of every activation, so only its exclusive cycles add up
+VOID write_time_profile()
+{
+    FILE* file_ptr = fopen(CYCLES_FILE_NAME, "w");
+    if (file_ptr == NULL) {
+        cerr << "Error: opening a file" << endl;
+        return;
+    }
+    for (auto it = timed_rtns.begin(); it != timed_rtns.end(); ++it) {
+        if ((*it)->incl_cycles == 0) {
+            continue;
+        }
+        fprintf(file_ptr, "%s,%lu,%lu\n", (*it)->rtn_name.c_str(), (*it)->incl_cycles, (*it)->excl_cycles);
+    }
+    fclose(file_ptr);
+}
@@ -0,0 +1,137 @@
+#include "src/telemetry.h"
+#include <algorithm>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <vector>
+
+/*
+ * Attaches to the telemetry segment of a running -prof -prof_telemetry process and prints
+ * its hottest routines and most executed branches every interval.
+ * usage: telemetry_reader.out [-n top] [-i interval_ms] [-1] [segment name]
+ */
+
+#define COPY_RETRIES 100
+
+static void usage()
+{
+    fprintf(stderr, "usage: telemetry_reader.out [-n top] [-i interval_ms] [-1] [segment name]\n");
+    exit(1);
+}
+
+// Copies the segment while no update is in progress, returns false if the writer kept it busy
+static bool copy_segment(const telemetry_segment* segment, telemetry_segment* copy)
+{
+    for (int i = 0; i < COPY_RETRIES; i++) {
+        uint64_t seq = __atomic_load_n(&segment->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            usleep(1000);
+            continue;
+        }
+        memcpy(copy, segment, sizeof(telemetry_segment));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&segment->seq, __ATOMIC_RELAXED) == seq) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void print_segment(const telemetry_segment* s, unsigned top)
+{
+    uint64_t total_ins = 0;
+    std::vector<uint32_t> rtns;
+    for (uint32_t i = 0; i < s->num_rtns; i++) {
+        total_ins += s->rtns[i].ins_count;
+        rtns.push_back(i);
+    }
+    std::sort(rtns.begin(), rtns.end(), [s](uint32_t a, uint32_t b) { return s->rtns[a].ins_count > s->rtns[b].ins_count; });
+    printf("pid %u, update %lu, %u routines, %lu instructions", s->pid, (unsigned long)s->publish_count, s->num_rtns, (unsigned long)total_ins);
+    if (s->dropped) {
+        printf(", %u entries did not fit", s->dropped);
+    }
+    printf("\n\n%-40s %16s %12s %7s\n", "routine", "instructions", "calls", "heat");
+    for (uint32_t i = 0; i < rtns.size() && i < top; i++) {
+        const telemetry_rtn* rtn = &s->rtns[rtns[i]];
+        printf("%-40.40s %16lu %12lu %6.2f%%\n", rtn->name, (unsigned long)rtn->ins_count, (unsigned long)rtn->rtn_count,
+            total_ins ? 100.0 * rtn->ins_count / total_ins : 0.0);
+    }
+
+    std::vector<uint32_t> branches;
+    for (uint32_t i = 0; i < s->num_branches; i++) {
+        branches.push_back(i);
+    }
+    std::sort(branches.begin(), branches.end(), [s](uint32_t a, uint32_t b) { return s->branches[a].count > s->branches[b].count; });
+    printf("\n%-40s %8s %12s %7s\n", "branch", "offset", "count", "taken");
+    for (uint32_t i = 0; i < branches.size() && i < top; i++) {
+        const telemetry_branch* branch = &s->branches[branches[i]];
+        printf("%-40.40s %#8x %12lu %6.2f%%\n", s->rtns[branch->rtn_index].name, branch->offset, (unsigned long)branch->count,
+            branch->count ? 100.0 * branch->taken / branch->count : 0.0);
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char* argv[])
+{
+    unsigned top = 10;
+    unsigned interval_ms = 1000;
+    bool once = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:i:1")) != -1) {
+        switch (opt) {
+        case 'n':
+            top = atoi(optarg);
+            break;
+        case 'i':
+            interval_ms = atoi(optarg);
+            break;
+        case '1':
+            once = true;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind + 1 < argc) {
+        usage();
+    }
+    const char* name = (optind < argc) ? argv[optind] : TELEMETRY_DEFAULT_NAME;
+
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        fprintf(stderr, "Error: cannot open the telemetry segment %s\n", name);
+        return 1;
+    }
+    void* addr = mmap(NULL, sizeof(telemetry_segment), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        fprintf(stderr, "Error: cannot map the telemetry segment %s\n", name);
+        return 1;
+    }
+    const telemetry_segment* segment = (const telemetry_segment*)addr;
+    if (__atomic_load_n(&segment->magic, __ATOMIC_ACQUIRE) != TELEMETRY_MAGIC || segment->version != TELEMETRY_VERSION) {
+        fprintf(stderr, "Error: %s is not a version %d telemetry segment\n", name, TELEMETRY_VERSION);
+        return 1;
+    }
+
+    telemetry_segment* copy = (telemetry_segment*)malloc(sizeof(telemetry_segment));
+    while (true) {
+        if (!copy_segment(segment, copy)) {
+            fprintf(stderr, "Error: the telemetry segment kept changing while it was read\n");
+        } else {
+            if (!once) {
+                printf("\033[H\033[2J"); // clear the terminal
+            }
+            print_segment(copy, top);
+        }
+        if (once) {
+            break;
+        }
+        usleep(interval_ms * 1000);
+    }
+    free(copy);
+    return 0;
+}